@@ -0,0 +1,1222 @@
+// Host benchmark for indexing on synthetic FAT32 images.
+//
+// Generates a FAT32 image holding /photos with a configurable number of sub
+// directories and photos, then runs the firmware's indexing code against it:
+// a full index build (as build_index() does it), the same build resumed in
+// slices (as done in the background across wakes), picking photos through
+// the shuffled index and updating the config. Reports time, sector reads and
+// writes and memory for each of them.
+//
+// SdFat is not available on the host, so the image is accessed through a
+// small FAT32 implementation providing the SdFile subset used by the
+// firmware. It caches like SdFat: one sector for directory and file data and
+// one for the FAT, written back when evicted or synced, with whole aligned
+// sectors transferred directly. FAT writes are mirrored to the second FAT.
+// Photo contents are never written, the image is a sparse file.
+//
+// Fragmentation is controlled by the number of directories filled in
+// parallel (--interleave): directory clusters then end up between the photo
+// data of other directories, as when copying several folders at once.
+// --lfn adds two long file name entries per photo, as made by desktop
+// systems for names not fitting 8.3.
+//
+// Build and run from the repository root:
+//   g++ -O2 -std=c++17 -Isrc bench/fat_bench.cpp -o fat_bench
+//   ./fat_bench [--dirs 100] [--files 1000] [--interleave 1] [--lfn] [--cluster-kib 32] [--image fat_bench.img]
+// Without --dirs and --files a series from 100 to 1M photos is run.
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "index_builder.h"
+#include "photo_index.h"
+
+#define SECTOR_SIZE 512
+#define FAT_EOC 0x0FFFFFFF
+#define FAT_RESERVED_SECTORS 32
+#define FAT_COUNT 2
+// 600x448 photo, a size the index builder accepts.
+#define PHOTO_SIZE (600 * 448 / 2)
+#define DIR_ENTRIES_PER_SECTOR (SECTOR_SIZE / sizeof(fat_dir_entry_t))
+
+typedef struct io_stats
+{
+  uint64_t sector_reads;
+  uint64_t sector_writes;
+} io_stats_t;
+
+// Sectors of an image file.
+class ImageDevice
+{
+public:
+  bool create(const char *path, uint64_t sectors)
+  {
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    return fd >= 0 && ftruncate(fd, sectors * SECTOR_SIZE) == 0;
+  }
+
+  void close_image()
+  {
+    close(fd);
+  }
+
+  bool read_sectors(uint32_t sector, uint8_t *buffer, uint32_t count)
+  {
+    stats.sector_reads += count;
+    return pread(fd, buffer, (size_t)count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) == (ssize_t)count * SECTOR_SIZE;
+  }
+
+  bool write_sectors(uint32_t sector, const uint8_t *buffer, uint32_t count)
+  {
+    stats.sector_writes += count;
+    return pwrite(fd, buffer, (size_t)count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) == (ssize_t)count * SECTOR_SIZE;
+  }
+
+  io_stats_t stats = {0, 0};
+
+private:
+  int fd = -1;
+};
+
+// Write back cache of a single sector.
+class SectorCache
+{
+public:
+  SectorCache(ImageDevice *device, uint32_t mirror_offset = 0) : device(device), mirror_offset(mirror_offset) {}
+
+  uint8_t *get(uint32_t sector, bool will_write)
+  {
+    if (sector != cached)
+    {
+      if (!flush())
+      {
+        return nullptr;
+      }
+      if (!device->read_sectors(sector, data, 1))
+      {
+        return nullptr;
+      }
+      cached = sector;
+    }
+    dirty = dirty || will_write;
+    return data;
+  }
+
+  bool flush()
+  {
+    if (!dirty)
+    {
+      return true;
+    }
+    dirty = false;
+    if (mirror_offset != 0 && !device->write_sectors(cached + mirror_offset, data, 1))
+    {
+      return false;
+    }
+    return device->write_sectors(cached, data, 1);
+  }
+
+  // Keeps the cache coherent with direct sector transfers.
+  bool holds(uint32_t sector) const
+  {
+    return sector == cached;
+  }
+
+  bool holds_any(uint32_t first, uint32_t count) const
+  {
+    return first <= cached && cached < first + count;
+  }
+
+  void invalidate()
+  {
+    cached = UINT32_MAX;
+    dirty = false;
+  }
+
+  uint8_t *data_ptr()
+  {
+    return data;
+  }
+
+private:
+  ImageDevice *device;
+  const uint32_t mirror_offset;
+  uint32_t cached = UINT32_MAX;
+  bool dirty = false;
+  uint8_t data[SECTOR_SIZE];
+};
+
+class FatVolume
+{
+public:
+  FatVolume(ImageDevice *device) : device(device), cache(device) {}
+
+  bool format(uint64_t total_sectors, uint8_t sectors_per_cluster)
+  {
+    this->sectors_per_cluster = sectors_per_cluster;
+    fat_sectors = 1;
+    while (true)
+    {
+      const uint64_t data = total_sectors - FAT_RESERVED_SECTORS - FAT_COUNT * fat_sectors;
+      const uint64_t clusters = data / sectors_per_cluster;
+      const uint32_t needed = ((clusters + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+      if (needed <= fat_sectors)
+      {
+        cluster_count = clusters;
+        break;
+      }
+      fat_sectors = needed;
+    }
+    data_start = FAT_RESERVED_SECTORS + FAT_COUNT * fat_sectors;
+    fat_cache.reset(new SectorCache(device, fat_sectors));
+
+    uint8_t boot[SECTOR_SIZE];
+    memset(boot, 0, sizeof(boot));
+    memcpy(boot, "\xEB\x58\x90MSWIN4.1", 11);
+    put16(boot + 11, SECTOR_SIZE);
+    boot[13] = sectors_per_cluster;
+    put16(boot + 14, FAT_RESERVED_SECTORS);
+    boot[16] = FAT_COUNT;
+    boot[21] = 0xF8;
+    put32(boot + 32, total_sectors);
+    put32(boot + 36, fat_sectors);
+    put32(boot + 44, 2);
+    put16(boot + 48, 1);
+    boot[66] = 0x29;
+    memcpy(boot + 71, "PHOTOFRAME FAT32   ", 19);
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+
+    uint8_t info[SECTOR_SIZE];
+    memset(info, 0, sizeof(info));
+    put32(info, 0x41615252);
+    put32(info + 484, 0x61417272);
+    put32(info + 488, 0xFFFFFFFF);
+    put32(info + 492, 0xFFFFFFFF);
+    info[510] = 0x55;
+    info[511] = 0xAA;
+
+    next_free = 3;
+    return device->write_sectors(0, boot, 1) && device->write_sectors(1, info, 1) && set_fat(0, 0x0FFFFFF8) &&
+           set_fat(1, FAT_EOC) && set_fat(2, FAT_EOC) && flush();
+  }
+
+  uint32_t cluster_sector(uint32_t cluster) const
+  {
+    return data_start + (cluster - 2) * sectors_per_cluster;
+  }
+
+  uint32_t cluster_bytes() const
+  {
+    return sectors_per_cluster * SECTOR_SIZE;
+  }
+
+  bool get_fat(uint32_t cluster, uint32_t *value)
+  {
+    const uint8_t *sector = fat_cache->get(FAT_RESERVED_SECTORS + cluster / 128, false);
+    if (sector == nullptr)
+    {
+      return false;
+    }
+    *value = get32(sector + (cluster % 128) * 4) & 0x0FFFFFFF;
+    return true;
+  }
+
+  bool set_fat(uint32_t cluster, uint32_t value)
+  {
+    uint8_t *sector = fat_cache->get(FAT_RESERVED_SECTORS + cluster / 128, true);
+    if (sector == nullptr)
+    {
+      return false;
+    }
+    put32(sector + (cluster % 128) * 4, value);
+    return true;
+  }
+
+  // Allocates a cluster and links it after previous, if not 0.
+  bool allocate(uint32_t previous, bool zero, uint32_t *cluster)
+  {
+    for (uint32_t i = 0; i < cluster_count; i++)
+    {
+      const uint32_t candidate = 2 + (next_free - 2 + i) % cluster_count;
+      uint32_t value;
+      if (!get_fat(candidate, &value))
+      {
+        return false;
+      }
+      if (value != 0)
+      {
+        continue;
+      }
+      if (!set_fat(candidate, FAT_EOC) || (previous != 0 && !set_fat(previous, candidate)))
+      {
+        return false;
+      }
+      next_free = candidate + 1;
+      *cluster = candidate;
+      if (zero)
+      {
+        std::vector<uint8_t> zeros(cluster_bytes(), 0);
+        const uint32_t first = cluster_sector(candidate);
+        if (cache.holds_any(first, sectors_per_cluster))
+        {
+          cache.invalidate();
+        }
+        return device->write_sectors(first, zeros.data(), sectors_per_cluster);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  bool free_chain(uint32_t cluster)
+  {
+    while (cluster >= 2 && cluster < FAT_EOC - 8)
+    {
+      uint32_t next;
+      if (!get_fat(cluster, &next) || !set_fat(cluster, 0))
+      {
+        return false;
+      }
+      if (cluster < next_free)
+      {
+        next_free = cluster;
+      }
+      cluster = next;
+    }
+    return true;
+  }
+
+  bool flush()
+  {
+    return cache.flush() && fat_cache->flush();
+  }
+
+  ImageDevice *device;
+  SectorCache cache;
+  std::unique_ptr<SectorCache> fat_cache;
+  uint8_t sectors_per_cluster = 64;
+  uint32_t fat_sectors = 0;
+  uint32_t data_start = 0;
+  uint32_t cluster_count = 0;
+  uint32_t next_free = 3;
+
+  static void put16(uint8_t *p, uint16_t v)
+  {
+    memcpy(p, &v, 2);
+  }
+
+  static void put32(uint8_t *p, uint32_t v)
+  {
+    memcpy(p, &v, 4);
+  }
+
+  static uint32_t get32(const uint8_t *p)
+  {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+  }
+};
+
+// 8.3 name as stored in a directory entry.
+static void short_name(const char *name, uint8_t *out)
+{
+  memset(out, ' ', 11);
+  const char *dot = strrchr(name, '.');
+  const size_t base = dot != nullptr ? dot - name : strlen(name);
+  for (size_t i = 0; i < base && i < 8; i++)
+  {
+    out[i] = toupper(name[i]);
+  }
+  if (dot != nullptr)
+  {
+    for (size_t i = 0; dot[1 + i] != '\0' && i < 3; i++)
+    {
+      out[8 + i] = toupper(dot[1 + i]);
+    }
+  }
+}
+
+// Subset of SdFile used by the firmware's index and config code.
+class BenchFile
+{
+public:
+  static FatVolume *volume;
+  static BenchFile root;
+
+  static void open_root()
+  {
+    root = BenchFile();
+    root.is_open = true;
+    root.is_dir = true;
+    root.writable = true;
+    root.first_cluster = 2;
+  }
+
+  bool open(BenchFile *dir, uint16_t index, int flags)
+  {
+    fat_dir_entry_t entry;
+    uint32_t sector;
+    if (!dir->entry_at(index, &entry, &sector))
+    {
+      return false;
+    }
+    if (entry.name[0] == FAT_NAME_FREE || entry.name[0] == FAT_NAME_DELETED ||
+        (entry.attributes & FAT_ATTR_LONG_NAME) == FAT_ATTR_LONG_NAME)
+    {
+      return false;
+    }
+    attach(dir, index, entry, flags);
+    return true;
+  }
+
+  // Files in the root directory only.
+  bool open(const char *path, int flags = O_RDONLY)
+  {
+    uint8_t name[11];
+    short_name(path[0] == '/' ? path + 1 : path, name);
+
+    fat_dir_entry_t entry;
+    uint32_t sector;
+    int32_t free_index = -1;
+    for (uint32_t index = 0; root.entry_at(index, &entry, &sector); index++)
+    {
+      if (entry.name[0] == FAT_NAME_FREE || entry.name[0] == FAT_NAME_DELETED)
+      {
+        if (free_index < 0)
+        {
+          free_index = index;
+        }
+        if (entry.name[0] == FAT_NAME_FREE)
+        {
+          break;
+        }
+        continue;
+      }
+      if (memcmp(entry.name, name, 11) == 0)
+      {
+        attach(&root, index, entry, flags);
+        return true;
+      }
+    }
+    if (!(flags & O_CREAT))
+    {
+      return false;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.name, name, 11);
+    entry.attributes = 0x20;
+    const uint16_t index = free_index >= 0 ? free_index : root.entry_count();
+    if (!root.put_entry(index, entry))
+    {
+      return false;
+    }
+    attach(&root, index, entry, flags);
+    return true;
+  }
+
+  bool isOpen() const
+  {
+    return is_open;
+  }
+
+  uint32_t fileSize() const
+  {
+    return size;
+  }
+
+  bool seekSet(uint32_t position)
+  {
+    if (!is_dir && position > size)
+    {
+      return false;
+    }
+    pos = position;
+    return true;
+  }
+
+  int read(void *buffer, size_t len)
+  {
+    uint8_t *out = (uint8_t *)buffer;
+    size_t done = 0;
+    if (!is_dir)
+    {
+      len = std::min<size_t>(len, size - pos);
+    }
+    while (done < len)
+    {
+      uint32_t sector;
+      if (!sector_at(pos, false, &sector))
+      {
+        break;
+      }
+      const uint32_t offset = pos % SECTOR_SIZE;
+      const uint32_t chunk = std::min<size_t>(SECTOR_SIZE - offset, len - done);
+      if (offset == 0 && chunk == SECTOR_SIZE && !volume->cache.holds(sector))
+      {
+        if (!volume->device->read_sectors(sector, out + done, 1))
+        {
+          return -1;
+        }
+      }
+      else
+      {
+        const uint8_t *data = volume->cache.get(sector, false);
+        if (data == nullptr)
+        {
+          return -1;
+        }
+        memcpy(out + done, data + offset, chunk);
+      }
+      done += chunk;
+      pos += chunk;
+    }
+    return done;
+  }
+
+  size_t write(const void *buffer, size_t len)
+  {
+    const uint8_t *in = (const uint8_t *)buffer;
+    size_t done = 0;
+    if (!writable)
+    {
+      return 0;
+    }
+    while (done < len)
+    {
+      uint32_t sector;
+      if (!sector_at(pos, true, &sector))
+      {
+        break;
+      }
+      const uint32_t offset = pos % SECTOR_SIZE;
+      const uint32_t chunk = std::min<size_t>(SECTOR_SIZE - offset, len - done);
+      if (offset == 0 && chunk == SECTOR_SIZE)
+      {
+        if (volume->cache.holds(sector))
+        {
+          volume->cache.invalidate();
+        }
+        if (!volume->device->write_sectors(sector, in + done, 1))
+        {
+          break;
+        }
+      }
+      else
+      {
+        uint8_t *data = volume->cache.get(sector, true);
+        if (data == nullptr)
+        {
+          break;
+        }
+        memcpy(data + offset, in + done, chunk);
+      }
+      done += chunk;
+      pos += chunk;
+      if (pos > size)
+      {
+        size = pos;
+      }
+      dirty = true;
+    }
+    return done;
+  }
+
+  bool sync()
+  {
+    if (dirty && parent_first_cluster != 0)
+    {
+      BenchFile parent = BenchFile::dir_at(parent_first_cluster);
+      fat_dir_entry_t entry;
+      uint32_t sector;
+      if (!parent.entry_at(entry_index, &entry, &sector))
+      {
+        return false;
+      }
+      entry.file_size = size;
+      entry.first_cluster_high = first_cluster >> 16;
+      entry.first_cluster_low = first_cluster & 0xFFFF;
+      if (!parent.put_entry(entry_index, entry))
+      {
+        return false;
+      }
+      dirty = false;
+    }
+    return volume->flush();
+  }
+
+  void flush()
+  {
+    sync();
+  }
+
+  void rewind()
+  {
+    pos = 0;
+  }
+
+  bool close()
+  {
+    const bool ok = !is_open || sync();
+    is_open = false;
+    return ok;
+  }
+
+  bool truncate(uint32_t length)
+  {
+    if (length != 0)
+    {
+      return false;
+    }
+    if (!volume->free_chain(first_cluster))
+    {
+      return false;
+    }
+    first_cluster = 0;
+    size = 0;
+    pos = 0;
+    cur_cluster = 0;
+    dirty = true;
+    return sync();
+  }
+
+  bool remove()
+  {
+    if (!writable || !volume->free_chain(first_cluster))
+    {
+      return false;
+    }
+    BenchFile parent = BenchFile::dir_at(parent_first_cluster);
+    fat_dir_entry_t entry;
+    uint32_t sector;
+    if (!parent.entry_at(entry_index, &entry, &sector))
+    {
+      return false;
+    }
+    entry.name[0] = FAT_NAME_DELETED;
+    is_open = false;
+    return parent.put_entry(entry_index, entry) && volume->flush();
+  }
+
+  // Like SdFat: a new entry is created and the old one deleted.
+  bool rename(const char *path)
+  {
+    if (!sync())
+    {
+      return false;
+    }
+    BenchFile target;
+    if (target.open(path, O_RDWR))
+    {
+      return false;
+    }
+    if (!target.open(path, O_RDWR | O_CREAT))
+    {
+      return false;
+    }
+    target.first_cluster = first_cluster;
+    target.size = size;
+    target.dirty = true;
+    if (!target.sync())
+    {
+      return false;
+    }
+    BenchFile parent = BenchFile::dir_at(parent_first_cluster);
+    fat_dir_entry_t entry;
+    uint32_t sector;
+    if (!parent.entry_at(entry_index, &entry, &sector))
+    {
+      return false;
+    }
+    entry.name[0] = FAT_NAME_DELETED;
+    if (!parent.put_entry(entry_index, entry))
+    {
+      return false;
+    }
+    parent_first_cluster = target.parent_first_cluster;
+    entry_index = target.entry_index;
+    return volume->flush();
+  }
+
+  static BenchFile dir_at(uint32_t cluster)
+  {
+    BenchFile dir;
+    dir.is_open = true;
+    dir.is_dir = true;
+    dir.writable = true;
+    dir.first_cluster = cluster;
+    return dir;
+  }
+
+  // Reads the entry at index through the cache.
+  bool entry_at(uint32_t index, fat_dir_entry_t *entry, uint32_t *sector)
+  {
+    if (!sector_at(index * sizeof(fat_dir_entry_t), false, sector))
+    {
+      return false;
+    }
+    const uint8_t *data = volume->cache.get(*sector, false);
+    if (data == nullptr)
+    {
+      return false;
+    }
+    memcpy(entry, data + (index % DIR_ENTRIES_PER_SECTOR) * sizeof(fat_dir_entry_t), sizeof(fat_dir_entry_t));
+    return true;
+  }
+
+  // Writes the entry at index through the cache, growing the directory as
+  // needed.
+  bool put_entry(uint32_t index, const fat_dir_entry_t &entry)
+  {
+    uint32_t sector;
+    if (!sector_at(index * sizeof(fat_dir_entry_t), true, &sector))
+    {
+      return false;
+    }
+    uint8_t *data = volume->cache.get(sector, true);
+    if (data == nullptr)
+    {
+      return false;
+    }
+    memcpy(data + (index % DIR_ENTRIES_PER_SECTOR) * sizeof(fat_dir_entry_t), &entry, sizeof(fat_dir_entry_t));
+    return true;
+  }
+
+  // Entries up to the first free one.
+  uint32_t entry_count()
+  {
+    fat_dir_entry_t entry;
+    uint32_t sector;
+    uint32_t index = 0;
+    while (entry_at(index, &entry, &sector) && entry.name[0] != FAT_NAME_FREE)
+    {
+      ++index;
+    }
+    return index;
+  }
+
+  uint32_t first_cluster = 0;
+  uint32_t size = 0;
+  // Directories created by the generator skip zeroing of new clusters, as
+  // the fresh image is all zeros.
+  bool zero_new_clusters = true;
+
+private:
+  void attach(BenchFile *dir, uint16_t index, const fat_dir_entry_t &entry, int flags)
+  {
+    is_open = true;
+    is_dir = entry.attributes & FAT_ATTR_DIRECTORY;
+    writable = (flags & O_ACCMODE) != O_RDONLY;
+    first_cluster = (uint32_t)entry.first_cluster_high << 16 | entry.first_cluster_low;
+    size = entry.file_size;
+    pos = 0;
+    cur_cluster = 0;
+    dirty = false;
+    parent_first_cluster = dir->first_cluster;
+    entry_index = index;
+  }
+
+  // Sector holding byte position, walking the cluster chain from the current
+  // cluster like SdFat does. Clusters are allocated, if allocate is set.
+  bool sector_at(uint32_t position, bool allocate, uint32_t *sector)
+  {
+    const uint32_t index = position / volume->cluster_bytes();
+    if (first_cluster == 0)
+    {
+      if (!allocate || !volume->allocate(0, is_dir && zero_new_clusters, &first_cluster))
+      {
+        return false;
+      }
+      dirty = true;
+    }
+    if (cur_cluster == 0 || index < cur_index)
+    {
+      cur_cluster = first_cluster;
+      cur_index = 0;
+    }
+    while (cur_index < index)
+    {
+      uint32_t next;
+      if (!volume->get_fat(cur_cluster, &next))
+      {
+        return false;
+      }
+      if (next >= FAT_EOC - 8)
+      {
+        if (!allocate || !volume->allocate(cur_cluster, is_dir && zero_new_clusters, &next))
+        {
+          return false;
+        }
+      }
+      cur_cluster = next;
+      ++cur_index;
+    }
+    *sector = volume->cluster_sector(cur_cluster) + (position % volume->cluster_bytes()) / SECTOR_SIZE;
+    return true;
+  }
+
+  bool is_open = false;
+  bool is_dir = false;
+  bool writable = false;
+  bool dirty = false;
+  uint32_t pos = 0;
+  uint32_t cur_cluster = 0;
+  uint32_t cur_index = 0;
+  uint32_t parent_first_cluster = 0;
+  uint16_t entry_index = 0;
+};
+
+FatVolume *BenchFile::volume = nullptr;
+BenchFile BenchFile::root;
+
+typedef struct generator_options
+{
+  uint32_t dirs;
+  uint32_t files;
+  uint32_t interleave;
+  bool lfn;
+  uint8_t cluster_kib;
+  const char *image;
+} generator_options_t;
+
+static fat_dir_entry_t make_entry(const char *name, uint8_t attributes, uint32_t cluster, uint32_t size)
+{
+  fat_dir_entry_t entry;
+  memset(&entry, 0, sizeof(entry));
+  memcpy(entry.name, name, 11);
+  entry.attributes = attributes;
+  entry.first_cluster_high = cluster >> 16;
+  entry.first_cluster_low = cluster & 0xFFFF;
+  entry.file_size = size;
+  return entry;
+}
+
+// Creates /photos with all sub directories and photos.
+static bool generate(const generator_options_t &options, FatVolume *volume)
+{
+  BenchFile photos;
+  if (!photos.open("/photos", O_RDWR | O_CREAT))
+  {
+    return false;
+  }
+  // Turn the new file entry into a directory.
+  uint32_t photos_cluster;
+  if (!volume->allocate(0, true, &photos_cluster))
+  {
+    return false;
+  }
+  {
+    fat_dir_entry_t entry;
+    uint32_t sector;
+    const uint32_t index = BenchFile::root.entry_count() - 1;
+    BenchFile::root.entry_at(index, &entry, &sector);
+    entry.attributes = FAT_ATTR_DIRECTORY;
+    entry.first_cluster_high = photos_cluster >> 16;
+    entry.first_cluster_low = photos_cluster & 0xFFFF;
+    BenchFile::root.put_entry(index, entry);
+  }
+
+  BenchFile parent = BenchFile::dir_at(photos_cluster);
+  parent.zero_new_clusters = false;
+  std::vector<BenchFile> dirs(options.dirs);
+  std::vector<uint32_t> next_entry(options.dirs, 2);
+  char name[16];
+  for (uint32_t d = 0; d < options.dirs; d++)
+  {
+    uint32_t cluster;
+    if (!volume->allocate(0, false, &cluster))
+    {
+      return false;
+    }
+    snprintf(name, sizeof(name), "D%07u   ", d);
+    if (!parent.put_entry(d + 2, make_entry(name, FAT_ATTR_DIRECTORY, cluster, 0)))
+    {
+      return false;
+    }
+    dirs[d] = BenchFile::dir_at(cluster);
+    dirs[d].zero_new_clusters = false;
+    dirs[d].put_entry(0, make_entry(".          ", FAT_ATTR_DIRECTORY, cluster, 0));
+    dirs[d].put_entry(1, make_entry("..         ", FAT_ATTR_DIRECTORY, photos_cluster, 0));
+  }
+  if (!parent.put_entry(0, make_entry(".          ", FAT_ATTR_DIRECTORY, photos_cluster, 0)) ||
+      !parent.put_entry(1, make_entry("..         ", FAT_ATTR_DIRECTORY, 0, 0)))
+  {
+    return false;
+  }
+
+  const uint32_t clusters_per_photo = (PHOTO_SIZE + volume->cluster_bytes() - 1) / volume->cluster_bytes();
+  uint32_t photo = 0;
+  for (uint32_t group = 0; group < options.dirs; group += options.interleave)
+  {
+    const uint32_t group_end = std::min(options.dirs, group + options.interleave);
+    for (uint32_t f = 0; f < options.files; f++)
+    {
+      for (uint32_t d = group; d < group_end; d++)
+      {
+        if (options.lfn)
+        {
+          fat_dir_entry_t lfn = make_entry("LONG NAME  ", FAT_ATTR_LONG_NAME, 0, 0);
+          dirs[d].put_entry(next_entry[d]++, lfn);
+          dirs[d].put_entry(next_entry[d]++, lfn);
+        }
+        uint32_t first = 0;
+        uint32_t previous = 0;
+        for (uint32_t c = 0; c < clusters_per_photo; c++)
+        {
+          uint32_t cluster;
+          if (!volume->allocate(previous, false, &cluster))
+          {
+            return false;
+          }
+          first = first != 0 ? first : cluster;
+          previous = cluster;
+        }
+        snprintf(name, sizeof(name), "P%07uBIN", photo++);
+        if (!dirs[d].put_entry(next_entry[d]++, make_entry(name, 0x20, first, PHOTO_SIZE)))
+        {
+          return false;
+        }
+      }
+    }
+  }
+  return photos.close() && volume->flush();
+}
+
+typedef std::chrono::steady_clock bench_clock;
+
+typedef struct phase_result
+{
+  double ms;
+  io_stats_t io;
+} phase_result_t;
+
+class Phase
+{
+public:
+  Phase(ImageDevice *device) : device(device), started(bench_clock::now()), before(device->stats) {}
+
+  phase_result_t done()
+  {
+    const phase_result_t result = {
+        std::chrono::duration<double, std::milli>(bench_clock::now() - started).count(),
+        {device->stats.sector_reads - before.sector_reads, device->stats.sector_writes - before.sector_writes},
+    };
+    return result;
+  }
+
+private:
+  ImageDevice *device;
+  bench_clock::time_point started;
+  io_stats_t before;
+};
+
+// Config as written by update_config().
+typedef struct bench_config
+{
+  char magic[20];
+  uint16_t version;
+  uint32_t photo_count;
+  uint32_t next_photo_index;
+  uint32_t shuffle_seed;
+  index_scan_state_t scan_state;
+} bench_config_t;
+
+// update_config() of the firmware.
+static bool update_config(const bench_config_t &config)
+{
+  BenchFile old_config;
+  BenchFile new_config;
+  if (!old_config.open("/config.bin", O_RDWR | O_CREAT) || !new_config.open("/~config.bin", O_RDWR | O_CREAT))
+  {
+    return false;
+  }
+  new_config.truncate(0);
+  new_config.rewind();
+  new_config.write(config.magic, sizeof(config.magic));
+  new_config.write(&config.version, sizeof(config.version));
+  new_config.write(&config.photo_count, sizeof(config.photo_count));
+  new_config.write(&config.next_photo_index, sizeof(config.next_photo_index));
+  new_config.write(&config.shuffle_seed, sizeof(config.shuffle_seed));
+  new_config.write(&config.scan_state, sizeof(config.scan_state));
+  new_config.flush();
+  return old_config.remove() && new_config.rename("/config.bin") && new_config.close();
+}
+
+// scan_index() and swap_index() of the firmware. Returns the number of
+// slices needed, each visiting at most slice_entries directory entries.
+static bool build_index(BenchFile *photos_dir, index_scan_state_t *state, uint32_t slice_entries, uint32_t *slices,
+                        size_t *builder_bytes)
+{
+  state->active = 0;
+  *slices = 0;
+  while (true)
+  {
+    BenchFile new_index;
+    if (!new_index.open("/~index.bin", O_RDWR | O_CREAT))
+    {
+      return false;
+    }
+    alignas(photo_index_t) static uint8_t buffer[INDEX_BUILDER_BUFFER_SIZE];
+    IndexBuilder<BenchFile> builder(photos_dir, &new_index, state, nullptr, buffer);
+    *builder_bytes = sizeof(builder) + sizeof(buffer);
+    if (!state->active)
+    {
+      new_index.truncate(0);
+      if (!builder.start(0))
+      {
+        return false;
+      }
+    }
+    uint32_t visited = 0;
+    if (!builder.step([&]() { return ++visited >= slice_entries; }))
+    {
+      return false;
+    }
+    new_index.close();
+    ++*slices;
+    if (state->complete)
+    {
+      break;
+    }
+  }
+
+  BenchFile old_index;
+  BenchFile new_index;
+  if (!new_index.open("/~index.bin", O_RDWR))
+  {
+    return false;
+  }
+  if (old_index.open("/index.bin", O_RDWR) && !old_index.remove())
+  {
+    return false;
+  }
+  return new_index.rename("/index.bin") && new_index.close();
+}
+
+static void print_row(const char *phase, uint32_t photos, const phase_result_t &result, uint32_t repeat)
+{
+  printf("%9u | %-18s | %10.2f | %12.1f | %12.1f\n", photos, phase, result.ms / repeat,
+         (double)result.io.sector_reads / repeat, (double)result.io.sector_writes / repeat);
+}
+
+static bool run(const generator_options_t &options)
+{
+  const uint32_t photos = options.dirs * options.files;
+  const uint32_t sectors_per_cluster = options.cluster_kib * 1024 / SECTOR_SIZE;
+  // Photos, directories and some room for the index, rounded up generously.
+  const uint64_t clusters =
+      (uint64_t)photos * ((PHOTO_SIZE + options.cluster_kib * 1024 - 1) / (options.cluster_kib * 1024)) +
+      (uint64_t)photos * 32 * (options.lfn ? 3 : 1) / (options.cluster_kib * 1024) + options.dirs * 2 +
+      (uint64_t)photos * sizeof(photo_index_t) / (options.cluster_kib * 1024) + 1024;
+  const uint64_t total_sectors = std::max<uint64_t>(clusters * sectors_per_cluster * 9 / 8, 66600 * 8);
+
+  ImageDevice device;
+  if (!device.create(options.image, total_sectors))
+  {
+    fprintf(stderr, "Could not create image '%s'\n", options.image);
+    return false;
+  }
+  FatVolume volume(&device);
+  BenchFile::volume = &volume;
+  if (!volume.format(total_sectors, sectors_per_cluster))
+  {
+    fprintf(stderr, "Could not format image\n");
+    return false;
+  }
+  BenchFile::open_root();
+
+  auto started = bench_clock::now();
+  if (!generate(options, &volume))
+  {
+    fprintf(stderr, "Could not generate photos\n");
+    return false;
+  }
+  const double generate_ms = std::chrono::duration<double, std::milli>(bench_clock::now() - started).count();
+  volume.cache.invalidate();
+  volume.fat_cache->invalidate();
+
+  BenchFile photos_dir;
+  if (!photos_dir.open("/photos", O_RDONLY))
+  {
+    fprintf(stderr, "Could not open /photos\n");
+    return false;
+  }
+
+  index_scan_state_t state;
+  uint32_t slices;
+  size_t builder_bytes = 0;
+
+  Phase full(&device);
+  if (!build_index(&photos_dir, &state, UINT32_MAX, &slices, &builder_bytes))
+  {
+    fprintf(stderr, "Could not build index\n");
+    return false;
+  }
+  const phase_result_t full_result = full.done();
+  if (state.count != photos)
+  {
+    fprintf(stderr, "Index holds %u photos, expected %u\n", state.count, photos);
+    return false;
+  }
+
+  // Background build: slices of 4096 visited entries, roughly what fits into
+  // the scan budget of a wake.
+  Phase sliced(&device);
+  if (!build_index(&photos_dir, &state, 4096, &slices, &builder_bytes) || state.count != photos)
+  {
+    fprintf(stderr, "Could not build index in slices\n");
+    return false;
+  }
+  const phase_result_t sliced_result = sliced.done();
+
+  // Picking photos: shuffle, then the index lookup and the open of the photo
+  // done by read_and_display_photo().
+  const uint32_t wakes = 1000;
+  BenchFile index_file;
+  uint32_t index_count = 0;
+  if (!index_file.open("/index.bin", O_RDONLY) || !read_index_header(&index_file, &index_count) || index_count != photos)
+  {
+    fprintf(stderr, "Could not read index header\n");
+    return false;
+  }
+  Phase pick(&device);
+  photo_index_t page[INDEX_ENTRIES_PER_PAGE];
+  const uint32_t seed = 0x5eed1234;
+  for (uint32_t cursor = 0; cursor < wakes; cursor++)
+  {
+    photo_index_t entry;
+    BenchFile dir;
+    BenchFile file;
+    volume.cache.invalidate();
+    volume.fat_cache->invalidate();
+    if (!read_index_entry(&index_file, shuffle_position(cursor % photos, photos, seed), page, &entry) ||
+        !dir.open(&photos_dir, entry.dir_index, O_RDONLY) || !file.open(&dir, entry.file_index, O_RDONLY) ||
+        file.fileSize() != PHOTO_SIZE)
+    {
+      fprintf(stderr, "Could not pick photo at cursor %u\n", cursor);
+      return false;
+    }
+  }
+  const phase_result_t pick_result = pick.done();
+
+  const uint32_t updates = 100;
+  bench_config_t config;
+  memset(&config, 0, sizeof(config));
+  memcpy(config.magic, "INKPLATE PHOTOFRAME", 20);
+  config.version = 4;
+  config.photo_count = photos;
+  config.scan_state = state;
+  Phase update(&device);
+  for (uint32_t i = 0; i < updates; i++)
+  {
+    config.next_photo_index = i;
+    if (!update_config(config))
+    {
+      fprintf(stderr, "Could not update config\n");
+      return false;
+    }
+  }
+  const phase_result_t update_result = update.done();
+
+  device.close_image();
+  remove(options.image);
+
+  char label[32];
+  print_row("build_index", photos, full_result, 1);
+  snprintf(label, sizeof(label), "sliced (%u)", slices);
+  print_row(label, photos, sliced_result, 1);
+  print_row("pick photo / wake", photos, pick_result, wakes);
+  print_row("update_config", photos, update_result, updates);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%9s   generated in %.0f ms, %u dirs x %u files, interleave %u%s, %u KiB clusters, image %.1f GiB sparse\n", "",
+         generate_ms, options.dirs, options.files, options.interleave, options.lfn ? ", lfn" : "", options.cluster_kib,
+         total_sectors * SECTOR_SIZE / 1073741824.0);
+  printf("%9s   IndexBuilder %zu bytes, index page %zu bytes, host peak RSS %ld KiB\n", "", builder_bytes,
+         sizeof(page), usage.ru_maxrss);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  generator_options_t options = {0, 0, 1, false, 32, "fat_bench.img"};
+
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if (arg == "--dirs" && i + 1 < argc)
+    {
+      options.dirs = strtoul(argv[++i], nullptr, 10);
+    }
+    else if (arg == "--files" && i + 1 < argc)
+    {
+      options.files = strtoul(argv[++i], nullptr, 10);
+    }
+    else if (arg == "--interleave" && i + 1 < argc)
+    {
+      options.interleave = std::max(1UL, strtoul(argv[++i], nullptr, 10));
+    }
+    else if (arg == "--cluster-kib" && i + 1 < argc)
+    {
+      options.cluster_kib = strtoul(argv[++i], nullptr, 10);
+    }
+    else if (arg == "--image" && i + 1 < argc)
+    {
+      options.image = argv[++i];
+    }
+    else if (arg == "--lfn")
+    {
+      options.lfn = true;
+    }
+    else
+    {
+      fprintf(stderr,
+              "Usage: %s [--dirs N] [--files N] [--interleave N] [--lfn] [--cluster-kib N] [--image path]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (options.cluster_kib == 0 || options.cluster_kib > 64 || (options.cluster_kib & (options.cluster_kib - 1)) != 0)
+  {
+    fprintf(stderr, "Cluster size needs to be a power of two up to 64 KiB\n");
+    return 1;
+  }
+  // Directory indices are 16 bit.
+  if ((uint64_t)options.files * (options.lfn ? 3 : 1) + 2 > UINT16_MAX || options.dirs + 2 > UINT16_MAX)
+  {
+    fprintf(stderr, "Too many entries per directory\n");
+    return 1;
+  }
+
+  printf("   photos | phase              |         ms | sector reads | sector writes\n");
+  if (options.dirs != 0 && options.files != 0)
+  {
+    return run(options) ? 0 : 1;
+  }
+
+  const uint32_t series[][2] = {{1, 100}, {10, 1000}, {100, 1000}, {1000, 1000}};
+  for (const auto &size : series)
+  {
+    options.dirs = size[0];
+    options.files = size[1];
+    if (!run(options))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
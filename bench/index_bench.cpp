@@ -0,0 +1,172 @@
+// Host benchmark for the paged photo index.
+//
+// Generates synthetic photo libraries, builds the index file using the same
+// code as the firmware and simulates a series of wakes, each reading the
+// entry at the current cursor. Reports build time, per wake I/O and per wake
+// time. Additionally verifies that a full cycle visits every photo once.
+//
+// Build and run from the repository root:
+//   g++ -O2 -std=c++17 -Isrc bench/index_bench.cpp -o index_bench && ./index_bench
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "photo_index.h"
+
+// Minimal stand-in for SdFile backed by a host file, counting all I/O.
+class HostFile
+{
+public:
+  bool open(const char *path)
+  {
+    fp = fopen(path, "w+b");
+    return fp != nullptr;
+  }
+
+  void close()
+  {
+    fclose(fp);
+  }
+
+  bool seekSet(uint32_t position)
+  {
+    ++seeks;
+    return fseek(fp, position, SEEK_SET) == 0;
+  }
+
+  int read(void *buffer, size_t len)
+  {
+    const size_t n_bytes = fread(buffer, 1, len, fp);
+    ++reads;
+    bytes_read += n_bytes;
+    return n_bytes;
+  }
+
+  size_t write(const void *buffer, size_t len)
+  {
+    const size_t n_bytes = fwrite(buffer, 1, len, fp);
+    ++writes;
+    bytes_written += n_bytes;
+    return n_bytes;
+  }
+
+  bool sync()
+  {
+    return fflush(fp) == 0;
+  }
+
+  void reset_stats()
+  {
+    seeks = reads = writes = bytes_read = bytes_written = 0;
+  }
+
+  FILE *fp = nullptr;
+  uint64_t seeks = 0;
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+  uint64_t bytes_read = 0;
+  uint64_t bytes_written = 0;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+static bool run(uint32_t photos, uint32_t wakes)
+{
+  const char *path = "index_bench.bin";
+  const uint16_t files_per_dir = 1000;
+  HostFile file;
+
+  if (!file.open(path))
+  {
+    fprintf(stderr, "Could not create %s\n", path);
+    return false;
+  }
+
+  // Synthetic library: photos spread across directories of files_per_dir
+  // entries each. Directory entry 0 and 1 are "." and "..".
+  photo_index_t page[INDEX_ENTRIES_PER_PAGE];
+  auto start = bench_clock::now();
+  PhotoIndexWriter<HostFile> writer(&file, page);
+  writer.begin();
+  for (uint32_t i = 0; i < photos; i++)
+  {
+    writer.append({.dir_index = (uint16_t)(i / files_per_dir + 2), .file_index = (uint16_t)(i % files_per_dir + 2)});
+  }
+  if (!writer.finish())
+  {
+    fprintf(stderr, "Could not write index\n");
+    return false;
+  }
+  const double build_ms = elapsed_ms(start);
+  const uint64_t build_bytes = file.bytes_written;
+
+  uint32_t count = 0;
+  if (!read_index_header(&file, &count) || count != photos)
+  {
+    fprintf(stderr, "Index header mismatch\n");
+    return false;
+  }
+
+  // Simulated wakes: read one entry, advance the cursor.
+  photo_index_t entry;
+  const uint32_t seed = 0x5eed1234;
+  uint64_t checksum = 0;
+  file.reset_stats();
+  start = bench_clock::now();
+  for (uint32_t cursor = 0; cursor < wakes; cursor++)
+  {
+    if (!read_index_entry(&file, shuffle_position(cursor % photos, photos, seed), page, &entry))
+    {
+      fprintf(stderr, "Could not read entry at cursor %u\n", cursor);
+      return false;
+    }
+    checksum += entry.dir_index ^ entry.file_index;
+  }
+  const double wake_us = elapsed_ms(start) * 1000 / wakes;
+  const double wake_bytes = (double)file.bytes_read / wakes;
+
+  // A full cycle has to be a permutation of the index.
+  start = bench_clock::now();
+  std::vector<bool> seen(photos, false);
+  for (uint32_t cursor = 0; cursor < photos; cursor++)
+  {
+    const uint32_t position = shuffle_position(cursor, photos, seed);
+    if (position >= photos || seen[position])
+    {
+      fprintf(stderr, "Shuffle is not a permutation at cursor %u\n", cursor);
+      return false;
+    }
+    seen[position] = true;
+  }
+  const double shuffle_ns = elapsed_ms(start) * 1e6 / photos;
+
+  printf("%9u | %9.1f | %10.1f | %9.1f | %9.0f | %10.1f | %llx\n", photos, build_ms, build_bytes / 1024.0, wake_us,
+         wake_bytes, shuffle_ns, (unsigned long long)checksum);
+
+  file.close();
+  remove(path);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  const uint32_t wakes = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000;
+  const uint32_t sizes[] = {10000, 100000, 1000000};
+
+  printf("   photos |  build ms |  index KiB |   wake us |    B/wake | shuffle ns | checksum\n");
+  for (uint32_t photos : sizes)
+  {
+    if (!run(photos, wakes))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
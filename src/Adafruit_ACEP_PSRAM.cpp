@@ -1,12 +1,19 @@
 #ifdef TINYPICO_WAVESHARE_EPD
 #include "Adafruit_ACEP_PSRAM.h"
+#include "esp_heap_caps.h"
+#include "trace.h"
 
 #define BUSY_WAIT 500
 
+// The panel is connected to the default pins of the VSPI bus.
+#define ACEP_SPI_HOST VSPI_HOST
+
 // clang-format off
 
+// The waits of the original sequence are states of the power state machine:
+// ACEP_RESET_SETTLE_MS before and ACEP_POWER_SETTLE_MS after the power
+// settings.
 const uint8_t acep_default_init_code[] {
-  0xFF, 10, // wait a lil bit
   ACEP_PANEL_SETTING, 2, 0xEF, 0x08, // LUT from OTP
     ACEP_POWER_SETTING, 4, 0x37, 0x00, 0x23, 0x23, // 0x05&0x05?
     ACEP_POWER_OFF_SEQUENCE, 1, 0x00,
@@ -17,8 +24,11 @@ const uint8_t acep_default_init_code[] {
     ACEP_TCON, 1, 0x22,
     ACEP_RESOLUTION, 4, 0x02, 0x58, 0x01, 0xC0,
     ACEP_PWS, 1, 0xAA,
-    0xFF, 100, // 100 ms delay
-    ACEP_CDI, 1, 0x37,
+    0xFE};
+
+const uint8_t acep_settled_init_code[] {
+  ACEP_CDI, 1, 0x37,
+    ACEP_RESOLUTION, 4, 0x02, 0x58, 0x01, 0xC0,
     0xFE};
 
 // clang-format on
@@ -34,10 +44,16 @@ const uint8_t acep_default_init_code[] {
     @param RST the reset pin to use
     @param CS the chip select pin to use
     @param BUSY the busy pin to use
+    @param spi the SPI bus the display is connected to
+    @param framebuffer memory of width * height / 2 bytes owned by the
+   caller, allocated from PSRAM if NULL
+    @param dma_buffer DMA capable internal memory of ACEP_DMA_BUFFER_SIZE
+   bytes owned by the caller, allocated if NULL
 */
 /**************************************************************************/
 Adafruit_ACEP_PSRAM::Adafruit_ACEP_PSRAM(int width, int height, int8_t DC, int8_t RST,
-                                         int8_t CS, int8_t BUSY, SPIClass *spi)
+                                         int8_t CS, int8_t BUSY, SPIClass *spi,
+                                         uint8_t *framebuffer, uint8_t *dma_buffer)
     : Adafruit_EPD(width, height, DC, RST, CS, -1, BUSY, spi)
 {
 
@@ -48,10 +64,27 @@ Adafruit_ACEP_PSRAM::Adafruit_ACEP_PSRAM(int width, int height, int8_t DC, int8_
   buffer1_size = width * height / 2;
   buffer2_size = 0;
 
-  buffer1 = (uint8_t *)ps_malloc(buffer1_size);
+  buffer1 = framebuffer != NULL ? framebuffer : (uint8_t *)ps_malloc(buffer1_size);
   buffer2 = buffer1;
 
+  // Commands are sent byte by byte, framebuffer data uses bulkWrite().
   singleByteTxns = true;
+  _spi_class = spi;
+  _bulk_device = NULL;
+  if (dma_buffer == NULL)
+  {
+    dma_buffer = (uint8_t *)heap_caps_malloc(ACEP_DMA_BUFFER_SIZE, MALLOC_CAP_DMA);
+  }
+  _dma_buffers[0] = dma_buffer;
+  _dma_buffers[1] = dma_buffer != NULL ? dma_buffer + ACEP_DMA_CHUNK_SIZE : NULL;
+
+  _state = ACEP_STATE_OFF;
+  _state_since = 0;
+  _clear_pending = false;
+  _cleared = false;
+  _timing_ms = 0;
+  _busy_ms = 0;
+  _blocked_ms = 0;
 }
 
 /**************************************************************************/
@@ -73,47 +106,21 @@ void Adafruit_ACEP_PSRAM::clearBuffer()
 
 /**************************************************************************/
 /*!
-    @brief clear all data buffers
+    @brief clear the panel to white, which removes ghosting of the previous
+   image. Powers the panel up first, if needed.
 */
 /**************************************************************************/
 void Adafruit_ACEP_PSRAM::deGhost()
 {
-  uint8_t buf[4];
-
-  buf[0] = 0x02;
-  buf[1] = 0x58;
-  buf[2] = 0x01;
-  buf[3] = 0xC0;
-  EPD_command(ACEP_RESOLUTION, buf, 4);
-
-  EPD_command(ACEP_DTM);
-  uint32_t remaining = (600UL * 448UL / 2);
-  while (remaining)
+  if (_state == ACEP_STATE_OFF)
   {
-    uint8_t block[256];
-    uint32_t numbytes = min(remaining, sizeof(block));
-    memset(block, 0x77, numbytes);
-    EPD_data(block, numbytes);
-    remaining -= numbytes;
-  }
-
-  EPD_command(ACEP_POWER_ON);
-  busy_wait();
-  EPD_command(ACEP_DISPLAY_REFRESH);
-  busy_wait();
-  EPD_command(ACEP_POWER_OFF);
-
-  if (_busy_pin >= 0)
-  {
-    while (digitalRead(_busy_pin))
-    { // wait for busy LOW
-      delay(10);
-    }
+    startPowerUp(true);
   }
   else
   {
-    delay(BUSY_WAIT);
+    _clear_pending = true;
   }
+  waitReady();
 }
 
 /**************************************************************************/
@@ -196,6 +203,18 @@ void Adafruit_ACEP_PSRAM::drawPixel(int16_t x, int16_t y, uint16_t color)
   }
 }
 
+/**************************************************************************/
+/*!
+    @brief direct access to the packed 4 bit framebuffer, two pixels per
+   byte with the left one in the high nibble. Only valid without rotation.
+    @returns pointer to the first row of the framebuffer
+*/
+/**************************************************************************/
+uint8_t *Adafruit_ACEP_PSRAM::getFramebuffer()
+{
+  return buffer1;
+}
+
 /**************************************************************************/
 /*!
     @brief wait for busy signal to end
@@ -203,17 +222,52 @@ void Adafruit_ACEP_PSRAM::drawPixel(int16_t x, int16_t y, uint16_t color)
 /**************************************************************************/
 void Adafruit_ACEP_PSRAM::busy_wait(void)
 {
+  const uint32_t started = millis();
+
   if (_busy_pin >= 0)
   {
     while (!digitalRead(_busy_pin))
     { // wait for busy high
-      delay(10);
+      delay(1);
     }
   }
   else
   {
     delay(BUSY_WAIT);
   }
+  _busy_ms += millis() - started;
+  _blocked_ms += millis() - started;
+}
+
+/**************************************************************************/
+/*!
+    @brief check the BUSY pin without blocking. Without a BUSY pin, BUSY_WAIT
+   after entering the current state counts as idle.
+    @returns true if BUSY is high
+*/
+/**************************************************************************/
+bool Adafruit_ACEP_PSRAM::busyHigh()
+{
+  if (_busy_pin >= 0)
+  {
+    return digitalRead(_busy_pin);
+  }
+  return millis() - _state_since >= BUSY_WAIT;
+}
+
+/**************************************************************************/
+/*!
+    @brief check the BUSY pin without blocking, see busyHigh()
+    @returns true if BUSY is low
+*/
+/**************************************************************************/
+bool Adafruit_ACEP_PSRAM::busyLow()
+{
+  if (_busy_pin >= 0)
+  {
+    return !digitalRead(_busy_pin);
+  }
+  return millis() - _state_since >= BUSY_WAIT;
 }
 
 /**************************************************************************/
@@ -225,7 +279,12 @@ void Adafruit_ACEP_PSRAM::busy_wait(void)
 void Adafruit_ACEP_PSRAM::begin(bool reset)
 {
   Adafruit_EPD::begin(reset);
-  delay(100);
+  // The bus stays with the DMA driver until endBulk(). Without it, all
+  // transfers go through the Arduino driver.
+  if (!beginBulk())
+  {
+    TRACE_E("Falling back to SPI transfers without DMA");
+  }
 }
 
 /**************************************************************************/
@@ -239,20 +298,13 @@ void Adafruit_ACEP_PSRAM::display(bool sleep)
   Serial.println("  Powering Up");
 #endif
 
-  powerUp();
-
-#ifdef EPD_DEBUG
-  Serial.println("  De Ghosting");
-#endif
-
-  deGhost();
-  delay(500);
-
-#ifdef EPD_DEBUG
-  Serial.println("  Powering Up");
-#endif
-
-  powerUp();
+  // Usually the power up and clearing of the panel was started early with
+  // startPowerUp() and ran while the image was prepared.
+  if (_state == ACEP_STATE_OFF || (_state == ACEP_STATE_READY && !_cleared))
+  {
+    startPowerUp(true);
+  }
+  waitReady();
 
 #ifdef EPD_DEBUG
   Serial.println("  Write frame buffer");
@@ -264,7 +316,8 @@ void Adafruit_ACEP_PSRAM::display(bool sleep)
   }
   else
   {
-    writeRAMFramebufferToEPD(buffer1, buffer1_size, 0);
+    command(ACEP_DTM);
+    bulkWrite(buffer1, buffer1_size, 0);
   }
 
 #ifdef EPD_DEBUG
@@ -272,6 +325,7 @@ void Adafruit_ACEP_PSRAM::display(bool sleep)
 #endif
   update();
   partialsSinceLastFullUpdate = 0;
+  _cleared = false;
 
   if (sleep)
   {
@@ -289,57 +343,414 @@ void Adafruit_ACEP_PSRAM::display(bool sleep)
 /**************************************************************************/
 void Adafruit_ACEP_PSRAM::update(void)
 {
-  EPD_command(ACEP_POWER_ON);
+  command(ACEP_POWER_ON);
   busy_wait();
-  EPD_command(ACEP_DISPLAY_REFRESH);
+  command(ACEP_DISPLAY_REFRESH);
   busy_wait();
-  EPD_command(ACEP_POWER_OFF);
+  command(ACEP_POWER_OFF);
+
+  const uint32_t started = millis();
   if (_busy_pin >= 0)
   {
     while (digitalRead(_busy_pin))
     { // wait for busy LOW
-      delay(10);
+      delay(1);
     }
   }
   else
   {
     delay(BUSY_WAIT);
   }
+  _busy_ms += millis() - started;
+  _blocked_ms += millis() - started;
+}
+
+/**************************************************************************/
+/*!
+    @brief hand the SPI bus over from the Arduino driver to the ESP-IDF
+   master driver, which allows DMA transfers. Done once in begin(), as
+   setting up the bus costs much of the time DMA saves.
+    @returns true if the bus could be set up
+*/
+/**************************************************************************/
+bool Adafruit_ACEP_PSRAM::beginBulk()
+{
+  if (_dma_buffers[0] == NULL)
+  {
+    TRACE_E("No DMA buffers");
+    return false;
+  }
+
+  _spi_class->end();
+
+  spi_bus_config_t bus = {};
+  bus.mosi_io_num = MOSI;
+  bus.miso_io_num = -1;
+  bus.sclk_io_num = SCK;
+  bus.quadwp_io_num = -1;
+  bus.quadhd_io_num = -1;
+  bus.max_transfer_sz = ACEP_DMA_CHUNK_SIZE;
+
+  spi_device_interface_config_t device = {};
+  device.clock_speed_hz = ACEP_SPI_FREQUENCY;
+  device.mode = 0;
+  // Chip select is driven manually to keep it low during the whole transfer.
+  device.spics_io_num = -1;
+  device.queue_size = 2;
+
+  if (spi_bus_initialize(ACEP_SPI_HOST, &bus, SPI_DMA_CH_AUTO) != ESP_OK)
+  {
+    TRACE_E("Could not initialize SPI bus for DMA");
+    _spi_class->begin();
+    return false;
+  }
+  if (spi_bus_add_device(ACEP_SPI_HOST, &device, &_bulk_device) != ESP_OK)
+  {
+    TRACE_E("Could not add SPI device for DMA");
+    spi_bus_free(ACEP_SPI_HOST);
+    _spi_class->begin();
+    return false;
+  }
+  return true;
 }
 
 /**************************************************************************/
 /*!
-    @brief start up the display
+    @brief release the SPI bus back to the Arduino driver, e.g. before
+   going to sleep
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::endBulk()
+{
+  if (_bulk_device == NULL)
+  {
+    return;
+  }
+  spi_bus_remove_device(_bulk_device);
+  spi_bus_free(ACEP_SPI_HOST);
+  _bulk_device = NULL;
+  _spi_class->begin();
+}
+
+/**************************************************************************/
+/*!
+    @brief send a single byte on the DMA device. Like the Arduino path
+   with singleByteTxns, chip select is toggled around every byte.
+    @param value the byte to send
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::writeByte(uint8_t value)
+{
+  spi_transaction_t transaction = {};
+
+  transaction.flags = SPI_TRANS_USE_TXDATA;
+  transaction.length = 8;
+  transaction.tx_data[0] = value;
+  csLow();
+  spi_device_polling_transmit(_bulk_device, &transaction);
+  csHigh();
+}
+
+/**************************************************************************/
+/*!
+    @brief send a command with its arguments, on the DMA device if it owns
+   the bus
+    @param c the command
+    @param buf the arguments
+    @param len the number of arguments
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::command(uint8_t c, const uint8_t *buf, uint16_t len)
+{
+  if (_bulk_device == NULL)
+  {
+    EPD_command(c, buf, len);
+    return;
+  }
+  csHigh();
+  dcLow();
+  writeByte(c);
+  dcHigh();
+  for (uint16_t i = 0; i < len; i++)
+  {
+    writeByte(buf[i]);
+  }
+}
+
+/**************************************************************************/
+/*!
+    @brief send a list of commands in the format of EPD_commandList()
+    @param init_code the list, terminated by 0xFE
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::commandList(const uint8_t *init_code)
+{
+  while (*init_code != 0xFE)
+  {
+    const uint8_t cmd = *init_code++;
+    const uint8_t num_args = *init_code++;
+    if (cmd == 0xFF)
+    {
+      busy_wait();
+      delay(num_args);
+      continue;
+    }
+    command(cmd, init_code, num_args);
+    init_code += num_args;
+  }
+}
+
+/**************************************************************************/
+/*!
+    @brief send a large block of data after a command in as few DMA
+   transactions as possible. The data is staged through two internal DMA
+   capable buffers, so copying the next chunk from PSRAM overlaps with
+   sending the current one.
+    @param data the data to send, or NULL to send fill instead
+    @param len the number of bytes to send
+    @param fill the byte to send, if data is NULL
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::bulkWrite(const uint8_t *data, uint32_t len, uint8_t fill)
+{
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+  const uint32_t started = micros();
+#endif
+
+  if (_bulk_device == NULL)
+  {
+    // Fall back to the slow path of the base class.
+    uint8_t block[256];
+    memset(block, fill, sizeof(block));
+    for (uint32_t offset = 0; offset < len; offset += sizeof(block))
+    {
+      const uint16_t n_bytes = min(len - offset, (uint32_t)sizeof(block));
+      EPD_data(data != NULL ? data + offset : block, n_bytes);
+    }
+    return;
+  }
+
+  if (data == NULL)
+  {
+    memset(_dma_buffers[0], fill, ACEP_DMA_CHUNK_SIZE);
+    memset(_dma_buffers[1], fill, ACEP_DMA_CHUNK_SIZE);
+  }
+
+  spi_transaction_t transactions[2];
+  spi_transaction_t *done;
+  uint8_t queued = 0;
+
+  csLow();
+  dcHigh();
+  for (uint32_t offset = 0, chunk = 0; offset < len; offset += ACEP_DMA_CHUNK_SIZE, chunk++)
+  {
+    const uint8_t slot = chunk % 2;
+    const uint32_t n_bytes = min(len - offset, (uint32_t)ACEP_DMA_CHUNK_SIZE);
+
+    if (queued == 2)
+    {
+      // Wait for the transaction which used this slot before.
+      spi_device_get_trans_result(_bulk_device, &done, portMAX_DELAY);
+      --queued;
+    }
+    if (data != NULL)
+    {
+      memcpy(_dma_buffers[slot], data + offset, n_bytes);
+    }
+
+    memset(&transactions[slot], 0, sizeof(spi_transaction_t));
+    transactions[slot].length = n_bytes * 8;
+    transactions[slot].tx_buffer = _dma_buffers[slot];
+    spi_device_queue_trans(_bulk_device, &transactions[slot], portMAX_DELAY);
+    ++queued;
+  }
+  while (queued > 0)
+  {
+    spi_device_get_trans_result(_bulk_device, &done, portMAX_DELAY);
+    --queued;
+  }
+  csHigh();
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+  const uint32_t elapsed = max(micros() - started, 1UL);
+  TRACE_POINT("panel.transfer", "bytes=%u us=%u kb_per_s=%u", len, elapsed, (uint32_t)((uint64_t)len * 1000000 / elapsed / 1024));
+#endif
+}
+
+/**************************************************************************/
+/*!
+    @brief start up the display, blocking until it is ready
 */
 /**************************************************************************/
 void Adafruit_ACEP_PSRAM::powerUp()
 {
-  uint8_t buf[5];
+  startPowerUp(false);
+  waitReady();
+}
 
-  hardwareReset();
-  delay(200);
-  busy_wait();
-  const uint8_t *init_code = acep_default_init_code;
+/**************************************************************************/
+/*!
+    @brief start powering up the display without blocking. The sequence is
+   advanced by poll(), which is meant to be called regularly while other work
+   is done, e.g. reading the image from the SD card.
+    @param clear if true the panel is cleared to white and initialized again
+   afterwards, which removes ghosting of the previous image.
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::startPowerUp(bool clear)
+{
+  _clear_pending = clear;
+  _cleared = false;
+  startReset();
+}
+
+/**************************************************************************/
+/*!
+    @brief advance the power state machine, if the BUSY pin or the minimum
+   timings allow it. Never blocks.
+    @returns true if no power sequence is in progress
+*/
+/**************************************************************************/
+bool Adafruit_ACEP_PSRAM::poll()
+{
+  const uint32_t in_state = millis() - _state_since;
 
-  if (_epd_init_code != NULL)
+  switch (_state)
   {
-    init_code = _epd_init_code;
+  case ACEP_STATE_RESET:
+    if (in_state >= ACEP_RESET_LOW_MS)
+    {
+      digitalWrite(_reset_pin, HIGH);
+      enterState(ACEP_STATE_BOOT);
+    }
+    return false;
+  case ACEP_STATE_BOOT:
+    if (in_state >= ACEP_RESET_SETTLE_MS && busyHigh())
+    {
+      commandList(_epd_init_code != NULL ? _epd_init_code : acep_default_init_code);
+      enterState(ACEP_STATE_SETTLE);
+    }
+    return false;
+  case ACEP_STATE_SETTLE:
+    if (in_state < ACEP_POWER_SETTLE_MS)
+    {
+      return false;
+    }
+    commandList(acep_settled_init_code);
+    enterState(ACEP_STATE_READY);
+    break;
+  case ACEP_STATE_CLEAR_ON:
+    if (busyHigh())
+    {
+      command(ACEP_DISPLAY_REFRESH);
+      enterState(ACEP_STATE_CLEAR_REFRESH);
+    }
+    return false;
+  case ACEP_STATE_CLEAR_REFRESH:
+    if (busyHigh())
+    {
+      command(ACEP_POWER_OFF);
+      enterState(ACEP_STATE_CLEAR_OFF);
+    }
+    return false;
+  case ACEP_STATE_CLEAR_OFF:
+    if (busyLow())
+    {
+      // The panel is initialized again for the image.
+      _cleared = true;
+      startReset();
+    }
+    return false;
+  default:
+    break;
   }
-  EPD_commandList(init_code);
 
-  // set resolution
-  buf[0] = 0x02;
-  buf[1] = 0x58;
-  buf[2] = 0x01;
-  buf[3] = 0xC0;
-  EPD_command(ACEP_RESOLUTION, buf, 4);
+  if (_state == ACEP_STATE_READY && _clear_pending)
+  {
+    startClear();
+    return false;
+  }
+  return true;
+}
 
-  delay(100);
+/**************************************************************************/
+/*!
+    @brief block until the power sequence in progress is done
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::waitReady()
+{
+  const uint32_t started = millis();
+
+  while (!poll())
+  {
+    delay(1);
+  }
+  _blocked_ms += millis() - started;
 }
 
 /**************************************************************************/
 /*!
-    @brief wind down the display
+    @brief switch the power state machine to a new state and account the
+   time spent in the previous one
+    @param state the new state
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::enterState(acep_power_state_t state)
+{
+  const uint32_t now = millis();
+
+  if (_state == ACEP_STATE_RESET || _state == ACEP_STATE_SETTLE)
+  {
+    _timing_ms += now - _state_since;
+  }
+  else if (_state != ACEP_STATE_OFF && _state != ACEP_STATE_READY)
+  {
+    _busy_ms += now - _state_since;
+  }
+  _state = state;
+  _state_since = now;
+}
+
+/**************************************************************************/
+/*!
+    @brief start a hardware reset, released by poll() after
+   ACEP_RESET_LOW_MS
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::startReset()
+{
+  if (_reset_pin >= 0)
+  {
+    pinMode(_reset_pin, OUTPUT);
+    digitalWrite(_reset_pin, LOW);
+    enterState(ACEP_STATE_RESET);
+  }
+  else
+  {
+    enterState(ACEP_STATE_BOOT);
+  }
+}
+
+/**************************************************************************/
+/*!
+    @brief fill the panel with white and start its refresh, which is
+   completed by poll()
+*/
+/**************************************************************************/
+void Adafruit_ACEP_PSRAM::startClear()
+{
+  _clear_pending = false;
+  command(ACEP_DTM);
+  bulkWrite(NULL, 600UL * 448UL / 2, 0x77);
+  command(ACEP_POWER_ON);
+  enterState(ACEP_STATE_CLEAR_ON);
+}
+
+/**************************************************************************/
+/*!
+    @brief wind down the display. Power off has been completed by update()
+   already, so the panel goes to deep sleep right away.
 */
 /**************************************************************************/
 
@@ -347,13 +758,12 @@ void Adafruit_ACEP_PSRAM::powerDown(void)
 {
   uint8_t buf[1];
 
-  delay(1000);
-
   // deep sleep
   buf[0] = 0xA5;
-  EPD_command(ACEP_DEEP_SLEEP, buf, 1);
+  command(ACEP_DEEP_SLEEP, buf, 1);
+  enterState(ACEP_STATE_OFF);
 
-  delay(100);
+  TRACE_POINT("panel.power", "timing_ms=%u busy_ms=%u blocked_ms=%u", _timing_ms, _busy_ms, _blocked_ms);
 }
 
 /**************************************************************************/
@@ -368,6 +778,11 @@ void Adafruit_ACEP_PSRAM::powerDown(void)
 uint8_t Adafruit_ACEP_PSRAM::writeRAMCommand(uint8_t index)
 {
   (void)index;
+  if (_bulk_device != NULL)
+  {
+    command(ACEP_DTM);
+    return 0;
+  }
   return EPD_command(ACEP_DTM, false);
 }
 
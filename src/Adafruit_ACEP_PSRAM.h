@@ -2,6 +2,7 @@
 
 #include "Adafruit_EPD.h"
 #include <Arduino.h>
+#include "driver/spi_master.h"
 
 #define ACEP_PANEL_SETTING 0x00
 #define ACEP_POWER_SETTING 0x01
@@ -19,6 +20,42 @@
 #define ACEP_RESOLUTION 0x61
 #define ACEP_PWS 0xE3
 
+// SPI clock used for framebuffer transfers. Lower it, if the panel shows
+// corrupted images.
+#ifndef ACEP_SPI_FREQUENCY
+#define ACEP_SPI_FREQUENCY 20000000
+#endif
+// Size of each of the two internal DMA buffers framebuffer data is staged
+// through on its way from PSRAM to the panel.
+#define ACEP_DMA_CHUNK_SIZE 8192
+#define ACEP_DMA_BUFFER_SIZE (2 * ACEP_DMA_CHUNK_SIZE)
+
+// Minimum timings of the power up sequence. Everything else waits for the
+// BUSY pin.
+#define ACEP_RESET_LOW_MS 10
+#define ACEP_RESET_SETTLE_MS 10
+#define ACEP_POWER_SETTLE_MS 100
+
+// States of the panel power sequence, see poll().
+typedef enum acep_power_state
+{
+  // Not initialized or in deep sleep.
+  ACEP_STATE_OFF,
+  // Reset pin held low.
+  ACEP_STATE_RESET,
+  // Reset released, waiting for the controller to boot.
+  ACEP_STATE_BOOT,
+  // Power settings sent, waiting for them to settle.
+  ACEP_STATE_SETTLE,
+  // Initialized, accepts commands and data.
+  ACEP_STATE_READY,
+  // Clearing the panel to white: waiting for power on, the refresh and
+  // power off.
+  ACEP_STATE_CLEAR_ON,
+  ACEP_STATE_CLEAR_REFRESH,
+  ACEP_STATE_CLEAR_OFF,
+} acep_power_state_t;
+
 #define ACEP_COLOR_BLACK 0x0  /// 000
 #define ACEP_COLOR_WHITE 0x1  ///	001
 #define ACEP_COLOR_GREEN 0x2  ///	010
@@ -35,12 +72,16 @@
 class Adafruit_ACEP_PSRAM : public Adafruit_EPD {
 public:
   Adafruit_ACEP_PSRAM(int width, int height, int8_t DC, int8_t RST, int8_t CS,
-                int8_t BUSY = -1, SPIClass *spi = &SPI);
+                int8_t BUSY = -1, SPIClass *spi = &SPI, uint8_t *framebuffer = NULL,
+                uint8_t *dma_buffer = NULL);
 
 
   void begin(bool reset = true);
   void powerUp();
   void powerDown();
+  void startPowerUp(bool clear = true);
+  bool poll();
+  void waitReady();
   void update();
   void display(bool sleep = true);
 
@@ -48,9 +89,35 @@ public:
   void clearDisplay();
   void deGhost();
   void drawPixel(int16_t x, int16_t y, uint16_t color);
+  uint8_t *getFramebuffer();
+  void endBulk();
 
 protected:
   uint8_t writeRAMCommand(uint8_t index);
   void setRAMAddress(uint16_t x, uint16_t y);
   void busy_wait();
+  bool busyHigh();
+  bool busyLow();
+  void enterState(acep_power_state_t state);
+  void startReset();
+  void startClear();
+  void bulkWrite(const uint8_t *data, uint32_t len, uint8_t fill);
+  bool beginBulk();
+  void writeByte(uint8_t value);
+  void command(uint8_t c, const uint8_t *buf = NULL, uint16_t len = 0);
+  void commandList(const uint8_t *init_code);
+
+  SPIClass *_spi_class;
+  spi_device_handle_t _bulk_device;
+  uint8_t *_dma_buffers[2];
+
+  acep_power_state_t _state;
+  uint32_t _state_since;
+  bool _clear_pending;
+  bool _cleared;
+  // Time spent in minimum timings, waiting for BUSY and blocked in
+  // waitReady() and update(), reported when powering down.
+  uint32_t _timing_ms;
+  uint32_t _busy_ms;
+  uint32_t _blocked_ms;
 };
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Fixed memory regions, reserved once at boot.
+//
+// Every buffer needed during a wake is described by a region with a size
+// known up front. arena_reserve() places all regions of a memory type in one
+// block, so a missing budget shows up right at boot, before anything is read
+// or drawn, instead of as a failed allocation halfway through a wake.
+//
+// Parts of a region are handed out with arena_take() and returned with
+// arena_release(). The most a region ever had in use is kept as its high
+// water mark, which tells how much room is left for bigger buffers. It only
+// says something for regions shared by several buffers, regions holding a
+// single buffer are sized to fit it.
+
+#define ARENA_ALIGNMENT 16
+
+typedef enum arena_memory
+{
+  // Large and slow, for framebuffers.
+  ARENA_PSRAM,
+  // Small and fast, for buffers touched per pixel.
+  ARENA_INTERNAL,
+  // Internal memory reachable by DMA, for SPI transfers.
+  ARENA_DMA,
+  ARENA_MEMORY_COUNT,
+} arena_memory_t;
+
+typedef struct arena_region
+{
+  const char *name;
+  uint8_t memory;
+  uint32_t size;
+  uint8_t *base;
+  uint32_t used;
+  uint32_t high_water;
+} arena_region_t;
+
+typedef struct arena
+{
+  arena_region_t *regions;
+  uint8_t count;
+  uint8_t *blocks[ARENA_MEMORY_COUNT];
+  uint32_t block_sizes[ARENA_MEMORY_COUNT];
+} arena_t;
+
+static inline uint32_t arena_align(uint32_t size)
+{
+  return (size + ARENA_ALIGNMENT - 1) & ~(uint32_t)(ARENA_ALIGNMENT - 1);
+}
+
+// Computes the size of the block of every memory type.
+inline void arena_layout(arena_t *arena, arena_region_t *regions, uint8_t count)
+{
+  arena->regions = regions;
+  arena->count = count;
+  for (uint8_t memory = 0; memory < ARENA_MEMORY_COUNT; memory++)
+  {
+    arena->blocks[memory] = nullptr;
+    arena->block_sizes[memory] = 0;
+  }
+  for (uint8_t i = 0; i < count; i++)
+  {
+    arena->block_sizes[regions[i].memory] += arena_align(regions[i].size);
+  }
+}
+
+// Allocates the blocks with allocate(memory, size) and places the regions in
+// them. Every block is attempted, so the blocks left null after a failure
+// are exactly the ones not available. Returns false, if a block could not be
+// allocated.
+template <typename Allocate>
+bool arena_reserve(arena_t *arena, Allocate allocate)
+{
+  uint32_t offsets[ARENA_MEMORY_COUNT] = {0};
+  bool reserved = true;
+
+  for (uint8_t memory = 0; memory < ARENA_MEMORY_COUNT; memory++)
+  {
+    if (arena->block_sizes[memory] == 0)
+    {
+      continue;
+    }
+    arena->blocks[memory] = (uint8_t *)allocate(memory, arena->block_sizes[memory]);
+    reserved = reserved && arena->blocks[memory] != nullptr;
+  }
+  if (!reserved)
+  {
+    return false;
+  }
+  for (uint8_t i = 0; i < arena->count; i++)
+  {
+    arena_region_t *region = &arena->regions[i];
+    region->base = region->size != 0 ? arena->blocks[region->memory] + offsets[region->memory] : nullptr;
+    region->used = 0;
+    region->high_water = 0;
+    offsets[region->memory] += arena_align(region->size);
+  }
+  return true;
+}
+
+// Returns size bytes following the part of the region in use, or null if the
+// region is too small.
+inline uint8_t *arena_take(arena_region_t *region, uint32_t size)
+{
+  if (region->base == nullptr || size > region->size - region->used)
+  {
+    return nullptr;
+  }
+  uint8_t *data = region->base + region->used;
+  region->used += size;
+  if (region->used > region->high_water)
+  {
+    region->high_water = region->used;
+  }
+  return data;
+}
+
+// Returns everything taken from the region since it was at used bytes.
+inline void arena_release(arena_region_t *region, uint32_t used)
+{
+  region->used = used;
+}
+
+// Takes the whole region, for regions holding a single buffer.
+inline uint8_t *arena_take_all(arena_region_t *region)
+{
+  return arena_take(region, region->size - region->used);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wake_schedule.h"
+
+// Wall clock and time zone from a text file on the SD card.
+//
+// Not every supported board has a battery backed clock, so the clock is set
+// from a file written when the card is prepared:
+//
+//   # Unix time in seconds, e.g. from date +%s
+//   time=1760000000
+//   # POSIX time zone, UTC if missing
+//   tz=CET-1CEST,M3.5.0,M10.5.0/3
+//
+// The RTC of the ESP32 keeps the clock running in deep sleep, so the time is
+// only applied while the clock is not set or behind the file, e.g. after the
+// file has been written again. After a power loss the clock restarts from
+// the time in the file. The time zone is not kept in deep sleep and applied
+// on every wake.
+
+#define CLOCK_FILE_MAX_SIZE 160
+#define CLOCK_TZ_MAX_LEN 64
+
+typedef struct clock_file
+{
+  // Seconds since the epoch, 0 if not given.
+  uint64_t seconds;
+  // Empty if not given.
+  char tz[CLOCK_TZ_MAX_LEN];
+} clock_file_t;
+
+// Parses key=value lines into clock. Returns false on unknown keys or
+// invalid values.
+inline bool parse_clock_file(const char *text, clock_file_t *clock)
+{
+  char line[80];
+
+  clock->seconds = 0;
+  clock->tz[0] = '\0';
+  while (*text != '\0')
+  {
+    const char *end = strchr(text, '\n');
+    const size_t len = end != nullptr ? end - text : strlen(text);
+    const size_t copied = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+    memcpy(line, text, copied);
+    line[copied] = '\0';
+    text += end != nullptr ? len + 1 : len;
+
+    char *value = strchr(line, '=');
+    if (line[0] == '#' || line[0] == '\r' || line[0] == '\0')
+    {
+      continue;
+    }
+    if (value == nullptr)
+    {
+      return false;
+    }
+    *value++ = '\0';
+    value[strcspn(value, "\r")] = '\0';
+
+    if (strcmp(line, "time") == 0)
+    {
+      clock->seconds = strtoull(value, nullptr, 10);
+      if (!wake_schedule_wall_clock(clock->seconds * 1000000))
+      {
+        return false;
+      }
+    }
+    else if (strcmp(line, "tz") == 0)
+    {
+      if (strlen(value) >= sizeof(clock->tz))
+      {
+        return false;
+      }
+      strcpy(clock->tz, value);
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Tells whether the time of the file is to be applied to a clock reading
+// now_us.
+inline bool clock_file_applies(const clock_file_t *clock, uint64_t now_us)
+{
+  return clock->seconds != 0 && (!wake_schedule_wall_clock(now_us) || clock->seconds * 1000000 > now_us);
+}
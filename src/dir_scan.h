@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "resample.h"
+#include "util.h"
+
+// Scanning of raw FAT directory entries.
+//
+// Directories are read like files in bulk, interpreting the 32 byte entries
+// directly. This avoids opening every file just to look at its attributes.
+// The position of an entry within its directory is the directory index used
+// by SdFile::open(dir, index, flags).
+//
+// Templated on the directory type, which needs to provide seekSet() and
+// read() with the semantics of SdFat's SdFile.
+
+#define FAT_ATTR_READ_ONLY 0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_LONG_NAME 0x0F
+
+#define FAT_NAME_FREE 0x00
+#define FAT_NAME_DELETED 0xE5
+
+#define DIR_SCAN_BUFFER_SIZE 512
+// Returned by scan_dir_entries() once the end of the directory is reached.
+#define DIR_SCAN_END 0xFFFFFFFF
+
+typedef struct fat_dir_entry
+{
+  uint8_t name[11];
+  uint8_t attributes;
+  uint8_t reserved;
+  uint8_t create_time_tenths;
+  uint16_t create_time;
+  uint16_t create_date;
+  uint16_t access_date;
+  uint16_t first_cluster_high;
+  uint16_t modify_time;
+  uint16_t modify_date;
+  uint16_t first_cluster_low;
+  uint32_t file_size;
+} __attribute__((packed)) fat_dir_entry_t;
+
+typedef struct dir_scan_entry
+{
+  uint16_t index;
+  uint8_t attributes;
+  uint32_t size;
+  uint32_t first_cluster;
+  // Modification date in the high and time in the low half.
+  uint32_t modified;
+  // Space padded 8.3 short name.
+  const uint8_t *name;
+  const uint8_t *extension;
+} dir_scan_entry_t;
+
+// Calls visit(entry) for every file or directory in dir, starting with the
+// entry at index. Long file name parts and deleted entries are skipped. visit
+// returns false to stop the scan.
+//
+// Returns the index to resume the scan from, or DIR_SCAN_END once all entries
+// have been visited.
+template <typename Dir, typename Visit>
+uint32_t scan_dir_entries(Dir *dir, uint32_t index, uint8_t *buffer, Visit visit)
+{
+  if (!dir->seekSet(index * sizeof(fat_dir_entry_t)))
+  {
+    return DIR_SCAN_END;
+  }
+
+  while (true)
+  {
+    const int n_bytes = dir->read(buffer, DIR_SCAN_BUFFER_SIZE);
+    if (n_bytes < (int)sizeof(fat_dir_entry_t))
+    {
+      return DIR_SCAN_END;
+    }
+
+    const fat_dir_entry_t *raw = (const fat_dir_entry_t *)buffer;
+    const fat_dir_entry_t *end = raw + n_bytes / sizeof(fat_dir_entry_t);
+    for (; raw < end; raw++, index++)
+    {
+      if (raw->name[0] == FAT_NAME_FREE)
+      {
+        return DIR_SCAN_END;
+      }
+      if (raw->name[0] == FAT_NAME_DELETED || (raw->attributes & FAT_ATTR_LONG_NAME) == FAT_ATTR_LONG_NAME)
+      {
+        continue;
+      }
+
+      const dir_scan_entry_t entry = {
+          .index = (uint16_t)index,
+          .attributes = raw->attributes,
+          .size = raw->file_size,
+          .first_cluster = (uint32_t)raw->first_cluster_high << 16 | raw->first_cluster_low,
+          .modified = (uint32_t)raw->modify_date << 16 | raw->modify_time,
+          .name = raw->name,
+          .extension = raw->name + 8,
+      };
+      if (!visit(entry))
+      {
+        return index + 1;
+      }
+    }
+  }
+}
+
+static ALWAYS_INLINE bool is_visible_entry(const dir_scan_entry_t &entry)
+{
+  return (entry.attributes & (FAT_ATTR_HIDDEN | FAT_ATTR_SYSTEM | FAT_ATTR_VOLUME_ID)) == 0 && entry.name[0] != '.';
+}
+
+inline bool is_photo_dir_entry(const dir_scan_entry_t &entry)
+{
+  return is_visible_entry(entry) && (entry.attributes & FAT_ATTR_DIRECTORY);
+}
+
+// Only files with the size of a known photo resolution are accepted. If
+// extension is not null (upper case, as stored in the short name), it has
+// to match as well.
+inline bool is_photo_file_entry(const dir_scan_entry_t &entry, const char *extension)
+{
+  photo_geometry_t geometry;
+
+  if (!is_visible_entry(entry) || (entry.attributes & FAT_ATTR_DIRECTORY) || entry.size == 0)
+  {
+    return false;
+  }
+  if (extension != nullptr)
+  {
+    for (uint8_t i = 0; i < 3; i++)
+    {
+      const char expected = *extension != '\0' ? *extension++ : ' ';
+      if (entry.extension[i] != expected)
+      {
+        return false;
+      }
+    }
+  }
+  return photo_geometry_for_size(entry.size, &geometry);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "dir_scan.h"
+#include "photo_index.h"
+
+// Resumable construction of a photo index.
+//
+// Scanning /photos is split into steps, each ending once a time budget is
+// used up. The position of the scan is kept in an index_scan_state_t, which
+// is meant to be persisted between wakes together with the rest of the
+// config. Until the scan is complete, the new index file is not valid and the
+// old index can still be used.
+//
+// Templated on the file type, which needs to provide open(dir, index, flags)
+// and close() in addition to the requirements of PhotoIndexWriter and
+// scan_dir_entries().
+
+typedef struct index_scan_state
+{
+  // A scan has been started and is not complete yet.
+  uint8_t active;
+  // The scan is complete and the new index is ready to be swapped in.
+  uint8_t complete;
+  // Directory index of the sub directory of /photos to continue with.
+  uint32_t dir_entry;
+  // Directory index within that sub directory to continue with.
+  uint32_t file_entry;
+  // Photos written to the new index so far.
+  uint32_t count;
+  // photo_library_signature() of /photos when the last scan started.
+  uint32_t signature;
+  // Wakes since the last scan started.
+  uint32_t idle_wakes;
+} index_scan_state_t;
+
+// Memory needed by an IndexBuilder: a page of the new index and a buffer for
+// each directory level.
+#define INDEX_BUILDER_BUFFER_SIZE (INDEX_PAGE_SIZE + 2 * DIR_SCAN_BUFFER_SIZE)
+
+// Signature of the directories in photos_dir: a hash of their names, first
+// clusters and modification times. It changes when directories are added,
+// removed or renamed. Systems updating the modification time of directories
+// (e.g. Linux) change it with every photo added or removed as well. Reads
+// only /photos itself, which takes a few sectors.
+template <typename Dir>
+uint32_t photo_library_signature(Dir *photos_dir, uint8_t *buffer)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  const auto mix = [&hash](const uint8_t *data, uint8_t len) {
+    for (uint8_t i = 0; i < len; i++)
+    {
+      hash = (hash ^ data[i]) * 16777619u;
+    }
+  };
+
+  scan_dir_entries(photos_dir, 0, buffer, [&](const dir_scan_entry_t &entry) {
+    if (is_photo_dir_entry(entry))
+    {
+      mix(entry.name, 11);
+      mix((const uint8_t *)&entry.first_cluster, sizeof(entry.first_cluster));
+      mix((const uint8_t *)&entry.modified, sizeof(entry.modified));
+    }
+    return true;
+  });
+  return hash;
+}
+
+template <typename File>
+class IndexBuilder
+{
+public:
+  // buffer holds INDEX_BUILDER_BUFFER_SIZE bytes, aligned for
+  // photo_index_t.
+  IndexBuilder(File *photos_dir, File *index, index_scan_state_t *state, const char *extension, uint8_t *buffer)
+      : photos_dir(photos_dir), writer(index, (photo_index_t *)buffer), state(state), extension(extension),
+        dir_buffer(buffer + INDEX_PAGE_SIZE), file_buffer(buffer + INDEX_PAGE_SIZE + DIR_SCAN_BUFFER_SIZE)
+  {
+  }
+
+  // Starts a new scan of the library with the given signature, truncating
+  // the index file.
+  bool start(uint32_t signature)
+  {
+    state->active = 1;
+    state->complete = 0;
+    state->dir_entry = 0;
+    state->file_entry = 0;
+    state->count = 0;
+    state->signature = signature;
+    state->idle_wakes = 0;
+    return writer.begin();
+  }
+
+  // Continues the scan until it is complete or out_of_time() returns true.
+  // Returns false on I/O errors.
+  template <typename OutOfTime>
+  bool step(OutOfTime out_of_time)
+  {
+    bool failed = false;
+    bool interrupted = false;
+
+    if (!state->active)
+    {
+      return true;
+    }
+    if (!writer.resume(state->count))
+    {
+      return false;
+    }
+
+    const uint32_t next_dir = scan_dir_entries(photos_dir, state->dir_entry, dir_buffer, [&](const dir_scan_entry_t &entry) {
+      File dir;
+
+      if (!is_photo_dir_entry(entry) || !dir.open(photos_dir, entry.index, O_RDONLY))
+      {
+        return !out_of_time();
+      }
+
+      const uint32_t next_file = scan_dir_entries(&dir, state->file_entry, file_buffer, [&](const dir_scan_entry_t &file) {
+        if (!is_photo_file_entry(file, extension))
+        {
+          return !out_of_time();
+        }
+        if (!writer.append({.dir_index = entry.index, .file_index = file.index}))
+        {
+          failed = true;
+          return false;
+        }
+        return writer.size() < MAX_PHOTOS && !out_of_time();
+      });
+      dir.close();
+
+      if (failed || writer.size() >= MAX_PHOTOS)
+      {
+        return false;
+      }
+      if (next_file != DIR_SCAN_END)
+      {
+        // Out of time within this directory, continue with it next time.
+        state->dir_entry = entry.index;
+        state->file_entry = next_file;
+        interrupted = true;
+        return false;
+      }
+      state->file_entry = 0;
+      return !out_of_time();
+    });
+
+    if (failed)
+    {
+      return false;
+    }
+
+    state->count = writer.size();
+    if (interrupted || (next_dir != DIR_SCAN_END && writer.size() < MAX_PHOTOS))
+    {
+      if (!interrupted)
+      {
+        state->dir_entry = next_dir;
+      }
+      return writer.suspend();
+    }
+
+    state->active = 0;
+    state->complete = 1;
+    return writer.finish();
+  }
+
+private:
+  File *photos_dir;
+  PhotoIndexWriter<File> writer;
+  index_scan_state_t *state;
+  const char *extension;
+  uint8_t *dir_buffer;
+  uint8_t *file_buffer;
+};
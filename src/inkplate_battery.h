@@ -1,6 +1,7 @@
 #pragma once
 
 #include "util.h"
+#include "trace.h"
 #include "Inkplate.h"
 
 // #define ALWAYS_SHOW_BATTERY
@@ -61,7 +62,6 @@ double ALWAYS_INLINE readInkplateBattery(Inkplate *display)
 #else
   double batteryLevel = display->readBattery();
 #endif
-  Serial.print("Battery level: ");
-  Serial.println(batteryLevel);
+  TRACE_I("Battery level: %.2f", batteryLevel);
   return batteryLevel;
 }
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <stdint.h>
+
+// Optional recorder for SD card I/O.
+//
+// Built with -DENABLE_IO_TRACE, every operation on an IoFile is recorded with
+// its sector, offset, length and duration into a buffer in RAM. Records carry
+// the phase of the wake they were issued in (see IO_TRACE_PHASE). Before going
+// to sleep the buffer is appended to IO_TRACE_FILE, so traces of many wakes
+// can be collected in the field and replayed on the host with
+// tools/io_replay.cpp.
+//
+// Without the flag IoFile is a plain SdFile and all trace statements expand
+// to nothing.
+//
+// The sector of an operation is the first sector of the file plus the offset
+// divided by the sector size. This is exact for contiguous files, which is
+// what SdFat creates on freshly formatted cards.
+
+#define IO_TRACE_FILE "/iotrace.bin"
+#define IO_TRACE_CAPACITY 512
+#define IO_TRACE_SECTOR_SIZE 512
+
+const char io_trace_magic[8] = "IOTRACE";
+
+typedef enum io_trace_op
+{
+  IO_OP_OPEN,
+  IO_OP_CLOSE,
+  IO_OP_READ,
+  IO_OP_WRITE,
+  IO_OP_SEEK,
+  IO_OP_SYNC,
+  IO_OP_TRUNCATE,
+  IO_OP_RENAME,
+  IO_OP_REMOVE,
+  // Starts the records of a wake. length holds the number of records
+  // following, sector the number of records dropped on overflow and offset
+  // the uptime in milliseconds when the trace was written.
+  IO_OP_WAKE,
+  IO_OP_COUNT,
+} io_trace_op_t;
+
+typedef enum io_trace_phase
+{
+  IO_PHASE_NONE,
+  IO_PHASE_INIT_CONFIG,
+  IO_PHASE_BUILD_INDEX,
+  IO_PHASE_SCAN_INDEX,
+  IO_PHASE_DISPLAY_PHOTO,
+  IO_PHASE_UPDATE_CONFIG,
+  IO_PHASE_COUNT,
+} io_trace_phase_t;
+
+typedef struct io_trace_record
+{
+  uint8_t op;
+  uint8_t phase;
+  // Distinguishes files opened during a wake, 0 for files not opened
+  // through an IoFile.
+  uint16_t file;
+  uint32_t sector;
+  // Position in the file before the operation.
+  uint32_t offset;
+  // Bytes read or written, the argument of other operations.
+  uint32_t length;
+  uint32_t duration_us;
+} io_trace_record_t;
+
+// A trace file starts with a header, followed by the records of every wake.
+typedef struct io_trace_header
+{
+  char magic[8];
+  uint32_t record_size;
+} io_trace_header_t;
+
+#if defined(ARDUINO) && defined(ENABLE_IO_TRACE)
+#include <Arduino.h>
+#include "SdFat.h"
+
+typedef struct io_trace
+{
+  uint8_t phase;
+  uint16_t next_file;
+  uint16_t count;
+  uint32_t dropped;
+  io_trace_record_t records[IO_TRACE_CAPACITY];
+} io_trace_t;
+
+static io_trace_t io_trace;
+
+inline void io_trace_add(uint8_t op, uint16_t file, uint32_t sector, uint32_t offset, uint32_t length, uint32_t duration_us)
+{
+  if (io_trace.count == IO_TRACE_CAPACITY)
+  {
+    ++io_trace.dropped;
+    return;
+  }
+  io_trace_record_t &record = io_trace.records[io_trace.count++];
+  record.op = op;
+  record.phase = io_trace.phase;
+  record.file = file;
+  record.sector = sector;
+  record.offset = offset;
+  record.length = length;
+  record.duration_us = duration_us;
+}
+
+// Appends the records of this wake to the trace file. The file is written
+// with a plain SdFile, so writing the trace does not show up in it.
+inline bool io_trace_flush()
+{
+  SdFile file;
+  io_trace_record_t wake = {IO_OP_WAKE, IO_PHASE_NONE, 0, io_trace.dropped, (uint32_t)millis(), io_trace.count, 0};
+
+  if (!file.open(IO_TRACE_FILE, O_WRONLY | O_CREAT | O_APPEND))
+  {
+    return false;
+  }
+  if (file.fileSize() == 0)
+  {
+    io_trace_header_t header;
+    memcpy(header.magic, io_trace_magic, sizeof(io_trace_magic));
+    header.record_size = sizeof(io_trace_record_t);
+    file.write(&header, sizeof(header));
+  }
+  file.write(&wake, sizeof(wake));
+  file.write(io_trace.records, io_trace.count * sizeof(io_trace_record_t));
+  io_trace.count = 0;
+  io_trace.dropped = 0;
+  return file.close();
+}
+
+// Sets the phase for the rest of the enclosing scope.
+class IoTracePhase
+{
+public:
+  IoTracePhase(uint8_t phase) : previous(io_trace.phase)
+  {
+    io_trace.phase = phase;
+  }
+
+  ~IoTracePhase()
+  {
+    io_trace.phase = previous;
+  }
+
+private:
+  const uint8_t previous;
+};
+
+// SdFile recording every operation. The methods hide the ones of SdFile, so
+// they are only traced when called through an IoFile.
+class IoFile : public SdFile
+{
+public:
+  bool open(const char *path, oflag_t oflag = O_RDONLY)
+  {
+    file = ++io_trace.next_file;
+    sector = 0;
+    return traced(IO_OP_OPEN, 0, [&]() { return SdFile::open(path, oflag); });
+  }
+
+  bool open(FatFile *dir, uint16_t index, oflag_t oflag)
+  {
+    file = ++io_trace.next_file;
+    sector = 0;
+    return traced(IO_OP_OPEN, index, [&]() { return SdFile::open(dir, index, oflag); });
+  }
+
+  bool close()
+  {
+    return traced(IO_OP_CLOSE, 0, [&]() { return SdFile::close(); });
+  }
+
+  int read(void *buffer, size_t len)
+  {
+    return traced_transfer(IO_OP_READ, [&]() { return SdFile::read(buffer, len); });
+  }
+
+  size_t write(const void *buffer, size_t len)
+  {
+    return traced_transfer(IO_OP_WRITE, [&]() { return SdFile::write(buffer, len); });
+  }
+
+  bool seekSet(uint32_t position)
+  {
+    return traced(IO_OP_SEEK, position, [&]() { return SdFile::seekSet(position); });
+  }
+
+  void rewind()
+  {
+    seekSet(0);
+  }
+
+  bool sync()
+  {
+    return traced(IO_OP_SYNC, 0, [&]() { return SdFile::sync(); });
+  }
+
+  void flush()
+  {
+    sync();
+  }
+
+  bool truncate(uint32_t length)
+  {
+    return traced(IO_OP_TRUNCATE, length, [&]() { return SdFile::truncate(length); });
+  }
+
+  bool rename(const char *path)
+  {
+    return traced(IO_OP_RENAME, 0, [&]() { return SdFile::rename(path); });
+  }
+
+  bool remove()
+  {
+    return traced(IO_OP_REMOVE, 0, [&]() { return SdFile::remove(); });
+  }
+
+private:
+  template <typename Operation>
+  auto traced(uint8_t op, uint32_t length, Operation operation) -> decltype(operation())
+  {
+    const uint32_t offset = curPosition();
+    const uint32_t started = micros();
+    const auto result = operation();
+    const uint32_t duration = micros() - started;
+    io_trace_add(op, file, first_sector() + offset / IO_TRACE_SECTOR_SIZE, offset, length, duration);
+    return result;
+  }
+
+  // Records the bytes actually transferred as the length, which is less than
+  // asked for at the end of the file and 0 on errors.
+  template <typename Operation>
+  auto traced_transfer(uint8_t op, Operation operation) -> decltype(operation())
+  {
+    const uint32_t offset = curPosition();
+    const uint32_t started = micros();
+    const auto result = operation();
+    const uint32_t duration = micros() - started;
+    const uint32_t length = result > 0 ? result : 0;
+    io_trace_add(op, file, first_sector() + offset / IO_TRACE_SECTOR_SIZE, offset, length, duration);
+    return result;
+  }
+
+  // New files only get a sector with their first write and closed files do
+  // not have one anymore, so the last known one is kept.
+  uint32_t first_sector()
+  {
+    if (isOpen())
+    {
+      sector = firstSector();
+    }
+    return sector;
+  }
+
+  uint16_t file = 0;
+  uint32_t sector = 0;
+};
+
+#define IO_TRACE_PHASE(phase) IoTracePhase io_trace_phase_guard(phase)
+#define IO_TRACE_FLUSH() io_trace_flush()
+#elif defined(ARDUINO)
+#include "SdFat.h"
+
+typedef SdFile IoFile;
+
+#define IO_TRACE_PHASE(phase) do {} while (0)
+#define IO_TRACE_FLUSH() do {} while (0)
+#endif
@@ -8,7 +8,20 @@
 #endif
 
 #include "SdFat.h"
+#include "trace.h"
+#include "arena.h"
+#include "clock_file.h"
+#include "io_trace.h"
+#include "photo_index.h"
+#include "index_builder.h"
+#include "resample.h"
+#include "overlay_sprites.h"
+#include "panel_backend.h"
+#include "strip_renderer.h"
+#include "tone_map.h"
+#include "wake_schedule.h"
 #include "driver/rtc_io.h"
+#include <sys/time.h>
 
 // Uncomment this line, if you have one of the newer inkplate 10s, which have a
 // different (darker) color spectrum.
@@ -17,11 +30,45 @@
 // #define ALWAYS_SHOW_BATTERY
 #define BATTERY_WARNING_LEVEL 3.6
 
-// #define uS_TO_SLEEP 10800000000 // 3h
-// #define uS_TO_SLEEP 5400000000 //1.5h
-// #define uS_TO_SLEEP 2700000000 //45m
-// #define uS_TO_SLEEP 10000000 // 5s
-#define uS_TO_SLEEP 15 * 60 * 1000 * 1000
+// Uncomment this line, to always show a status bar with battery level, the
+// position of the photo in the current cycle and the time.
+// #define SHOW_STATUS_BAR
+#define STATUS_BAR_HEIGHT 27
+#define STATUS_BAR_PADDING 3
+
+// Uncomment this line, to only index files with the given extension (as
+// stored in the 8.3 short name, upper case).
+// #define PHOTO_FILE_EXTENSION "BIN"
+
+// Time spent per wake on rebuilding the photo index in the background.
+#define INDEX_SCAN_BUDGET_MS 500
+// The index is rebuilt once the directories in /photos changed, or after this
+// many wakes, as photos added to a directory do not always change it.
+#define INDEX_RESCAN_WAKES 96
+
+// Photos made for a different panel resolution are scaled to cover the whole
+// panel (FIT_CROP) or to fit into it, leaving the background visible at the
+// edges (FIT_LETTERBOX).
+#define PHOTO_FIT FIT_CROP
+
+// Time between wakes. Wakes happen at multiples of it on the clock, e.g.
+// every full quarter hour, see wake_schedule.h.
+// #define uS_TO_SLEEP 10800000000ULL // 3h
+// #define uS_TO_SLEEP 5400000000ULL //1.5h
+// #define uS_TO_SLEEP 2700000000ULL //45m
+// #define uS_TO_SLEEP 10000000ULL // 5s
+#define uS_TO_SLEEP (15ULL * 60 * 1000 * 1000)
+
+// Uncomment these lines, to not wake up at all between these local hours,
+// e.g. at night. Only works once the clock has been set from CLOCK_FILE.
+// #define QUIET_HOURS_START 23
+// #define QUIET_HOURS_END 7
+#ifndef QUIET_HOURS_START
+#define QUIET_HOURS_START 0
+#define QUIET_HOURS_END 0
+#endif
+// Time and time zone, see clock_file.h.
+#define CLOCK_FILE "/clock.txt"
 
 #ifdef TINYPICO_WAVESHARE_EPD
 #define EPD_CS 14
@@ -40,36 +87,70 @@
 #define E_INK_HEIGHT 448
 #endif
 
-typedef struct photo_index
-{
-  uint16_t dir_index;
-  uint16_t file_index;
-} photo_index_t;
+#ifdef TINYPICO_WAVESHARE_EPD
+typedef AcepPanel Panel;
+#elif ARDUINO_INKPLATECOLOR
+typedef InkplateColorPanel Panel;
+#else
+typedef InkplateGrayPanel<E_INK_WIDTH, E_INK_HEIGHT> Panel;
+#endif
+typedef PanelLayout<Panel> Layout;
 
-#define MAX_PHOTOS 32767
 const char config_magic[20] = "INKPLATE PHOTOFRAME";
 #define CONFIG_MAGIC_LEN sizeof(config_magic)
-// Allocated in psram
-photo_index_t *photo_index_list;
-#define CONFIG_PHOTO_INDEX_LEN (sizeof(photo_index_t) * MAX_PHOTOS)
-uint16_t photo_count;
+const uint16_t config_version = 4;
+#define CONFIG_VERSION_LEN sizeof(config_version)
+uint32_t photo_count;
 #define CONFIG_PHOTO_COUNT_LEN sizeof(photo_count)
-uint16_t next_photo_index;
+uint32_t next_photo_index;
 #define CONFIG_NEXT_PHOTO_INDEX_LEN sizeof(next_photo_index)
+uint32_t shuffle_seed;
+#define CONFIG_SHUFFLE_SEED_LEN sizeof(shuffle_seed)
+// Progress of the index scan running in the background across wakes.
+index_scan_state_t scan_state;
+#define CONFIG_SCAN_STATE_LEN sizeof(scan_state)
+#ifdef PHOTO_FILE_EXTENSION
+const char *photo_file_extension = PHOTO_FILE_EXTENSION;
+#else
+const char *photo_file_extension = nullptr;
+#endif
+// Only the page containing the current photo is ever held in memory.
+photo_index_t *index_page;
+// One line of accumulators for resampling photos of a different resolution.
+uint16_t *resample_acc;
+// Photo to panel values, built from the panel's calibration file at boot.
+tone_map_t tone_map;
+// Strip of the framebuffer being rendered, in internal RAM.
+uint8_t *render_strip;
+// Drawn over the photo while rendering it, empty if not shown.
+overlay_t status_bar;
+// Survives deep sleep, cleared on power up.
+RTC_DATA_ATTR wake_schedule_t wake_schedule;
 
 #define HARD_ERROR(x) { \
     display->println(x); \
-    log_d(x); \
+    TRACE_E(x); \
     display->display(); \
-    goto_sleep(uS_TO_SLEEP); \
+    goto_sleep(next_sleep_us()); \
+    return; \
+}
+
+// Like HARD_ERROR, for a photo which can not be shown because the index is
+// out of date. See recover_photo_error().
+#define PHOTO_ERROR(x) { \
+    display->println(x); \
+    TRACE_E(x); \
+    recover_photo_error(); \
+    display->display(); \
+    goto_sleep(next_sleep_us()); \
     return; \
 }
 
 #ifndef TINYPICO_WAVESHARE_EPD
-static uint8_t displayObjStorage[sizeof(Inkplate)];
+typedef Inkplate Display;
 Inkplate *display;
 #else
-static uint8_t displayObjStorage[sizeof(Adafruit_ACEP_PSRAM)];
+typedef Adafruit_ACEP_PSRAM Display;
 SPIClass vspi_class(VSPI);
 SPIClass hspi_class(HSPI);
 Adafruit_ACEP_PSRAM *display;
@@ -78,46 +159,226 @@ SdFat sd;
 TinyPICO tp = TinyPICO();
 #endif
 
-SdFile photos_dir;
-SdFile config;
+IoFile photos_dir;
+IoFile config;
+IoFile index_file;
+
+// Rows of photos being resampled, calibration and clock files.
+#define IO_BUFFER_SIZE 1024
 
-void check_battery()
+enum
+{
+  REGION_DISPLAY,
+  REGION_FRAMEBUFFER,
+  REGION_DMA,
+  REGION_INDEX_PAGE,
+  REGION_RENDER_STRIP,
+  REGION_RESAMPLE,
+  // Regions from here on are shared by buffers taken and released during
+  // the wake, only their high water marks are logged.
+  REGION_IO,
+  REGION_INDEX_SCAN,
+  REGION_COUNT,
+};
+
+// All memory of a wake, see arena.h. The Inkplate library allocates its
+// framebuffers itself in begin(), which is reported separately.
+arena_region_t regions[REGION_COUNT] = {
+    {"display", ARENA_INTERNAL, sizeof(Display)},
+#ifdef TINYPICO_WAVESHARE_EPD
+    {"framebuffer", ARENA_PSRAM, Layout::size},
+    {"dma", ARENA_DMA, ACEP_DMA_BUFFER_SIZE},
+#else
+    {"framebuffer", ARENA_PSRAM, 0},
+    {"dma", ARENA_DMA, 0},
+#endif
+    {"index page", ARENA_INTERNAL, INDEX_PAGE_SIZE},
+    {"render strip", ARENA_INTERNAL, RENDER_STRIP_ROWS * Layout::stride},
+    {"resample", ARENA_INTERNAL, Panel::width * sizeof(uint16_t)},
+    {"io", ARENA_INTERNAL, IO_BUFFER_SIZE},
+    {"index scan", ARENA_INTERNAL, INDEX_BUILDER_BUFFER_SIZE},
+};
+arena_t arena;
+
+bool format_time(char *text, size_t len)
+{
+  time_t now = time(nullptr);
+  struct tm local;
+
+  localtime_r(&now, &local);
+  // The clock has never been set, if it is still in the seventies.
+  if (local.tm_year + 1900 < 2020)
+  {
+    return false;
+  }
+  snprintf(text, len, "%02d:%02d", local.tm_hour, local.tm_min);
+  return true;
+}
+
+void build_status_bar(uint32_t photo_position)
 {
 #ifndef TINYPICO_WAVESHARE_EPD
   double batteryLevel = readInkplateBattery(display);
 #else
   float batteryLevel = tp.GetBatteryVoltage();
 #endif
-  log_d("Battery level: %lf", batteryLevel);
-#ifndef ALWAYS_SHOW_BATTERY
-  if (batteryLevel < BATTERY_WARNING_LEVEL)
+  const bool battery_low = batteryLevel < BATTERY_WARNING_LEVEL;
+  overlay_t *overlay = &status_bar;
+
+  overlay_begin_bar(overlay, 0, 0, Panel::overlay_ink, Panel::overlay_paper);
+#if !defined(ALWAYS_SHOW_BATTERY) && !defined(SHOW_STATUS_BAR)
+  if (!battery_low)
   {
+    return;
+  }
 #endif
-#ifndef TINYPICO_WAVESHARE_EPD
-    display->setTextColor(7, 0);
-#else
-  display->setTextColor(ACEP_COLOR_WHITE, ACEP_COLOR_BLACK);
-#endif
-    display->setCursor(0, E_INK_HEIGHT - 26);
-    display->print("Battery level low! (");
-    display->print(batteryLevel);
-    display->println(")");
-#ifndef ALWAYS_SHOW_BATTERY
+
+  char text[24];
+  const uint16_t y = Panel::height - STATUS_BAR_HEIGHT + STATUS_BAR_PADDING;
+  uint16_t x = STATUS_BAR_PADDING;
+
+  overlay_begin_bar(overlay, Panel::height - STATUS_BAR_HEIGHT, STATUS_BAR_HEIGHT, Panel::overlay_ink, Panel::overlay_paper);
+  x = overlay_add_sprite(overlay, &sprite_battery, x, y) + OVERLAY_SCALE * 2;
+  snprintf(text, sizeof(text), "%.2fV", batteryLevel);
+  x = overlay_add_text(overlay, text, x, y) + OVERLAY_SCALE * 2;
+  if (battery_low)
+  {
+    overlay_add_sprite(overlay, &sprite_label_low, x, y);
+  }
+
+#ifdef SHOW_STATUS_BAR
+  snprintf(text, sizeof(text), "%u/%u", photo_position + 1, photo_count);
+  overlay_add_text(overlay, text, (Panel::width - overlay_text_width(text)) / 2, y);
+  if (format_time(text, sizeof(text)))
+  {
+    overlay_add_text(overlay, text, Panel::width - STATUS_BAR_PADDING - overlay_text_width(text), y);
   }
 #endif
 }
 
+// Advances work running in the background of the panel, while the CPU is
+// busy with the SD card.
+void panel_poll()
+{
+  Panel::poll(display);
+}
+
+const char *memory_name(uint8_t memory)
+{
+  switch (memory)
+  {
+  case ARENA_PSRAM:
+    return "psram";
+  case ARENA_DMA:
+    return "dma";
+  default:
+    return "internal";
+  }
+}
+
+uint32_t memory_caps(uint8_t memory)
+{
+  switch (memory)
+  {
+  case ARENA_PSRAM:
+    return MALLOC_CAP_SPIRAM;
+  case ARENA_DMA:
+    return MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  default:
+    return MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  }
+}
+
+// Reserves the memory of all regions. Without it not even an error can be
+// shown, so a failure is only reported through the log, region by region.
+bool reserve_memory()
+{
+  arena_layout(&arena, regions, REGION_COUNT);
+  const bool reserved = arena_reserve(&arena, [](uint8_t memory, uint32_t size) -> void * {
+    return heap_caps_malloc(size, memory_caps(memory));
+  });
+
+  for (uint8_t i = 0; i < REGION_COUNT; i++)
+  {
+    TRACE_I("Region %-12s %-8s %6u bytes", regions[i].name, memory_name(regions[i].memory), regions[i].size);
+  }
+  for (uint8_t memory = 0; memory < ARENA_MEMORY_COUNT; memory++)
+  {
+    if (!reserved && arena.block_sizes[memory] != 0 && arena.blocks[memory] == nullptr)
+    {
+      TRACE_E("Memory budget exceeded: %u bytes of %s needed, largest free block is %u bytes", arena.block_sizes[memory],
+              memory_name(memory), heap_caps_get_largest_free_block(memory_caps(memory)));
+    }
+    else
+    {
+      TRACE_I("Arena %-8s %6u bytes, %u bytes left", memory_name(memory), arena.block_sizes[memory],
+              heap_caps_get_free_size(memory_caps(memory)));
+    }
+  }
+  if (!reserved)
+  {
+    return false;
+  }
+
+  index_page = (photo_index_t *)arena_take_all(&regions[REGION_INDEX_PAGE]);
+  render_strip = arena_take_all(&regions[REGION_RENDER_STRIP]);
+  resample_acc = (uint16_t *)arena_take_all(&regions[REGION_RESAMPLE]);
+  return true;
+}
+
+// Logs how much of the shared regions and of the remaining heaps this wake
+// needed at most.
+void log_memory_high_water()
+{
+  for (uint8_t i = REGION_IO; i < REGION_COUNT; i++)
+  {
+    TRACE_POINT("memory.region", "name=%s used=%u size=%u", regions[i].name, regions[i].high_water, regions[i].size);
+  }
+  TRACE_POINT("memory.heap", "internal_min_free=%u psram_min_free=%u stack_min_free=%u",
+              heap_caps_get_minimum_free_size(memory_caps(ARENA_INTERNAL)),
+              heap_caps_get_minimum_free_size(memory_caps(ARENA_PSRAM)), uxTaskGetStackHighWaterMark(NULL));
+}
+
+// Time on the RTC clock, which keeps running in deep sleep.
+uint64_t rtc_time_us()
+{
+  struct timeval now;
+
+  gettimeofday(&now, nullptr);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+// Records the start of the wake, which started at arrived_us.
+void arrive_on_schedule(uint64_t arrived_us)
+{
+  int64_t late_us;
+
+  if (wake_schedule_arrive(&wake_schedule, arrived_us, esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER, &late_us))
+  {
+    TRACE_POINT("wake.arrived", "late_us=%lld drift_ppm=%d correction_us=%d", late_us,
+                wake_schedule_drift_ppm(&wake_schedule, late_us), wake_schedule.correction_us);
+  }
+}
+
+// Schedules the next wake and returns the time to sleep until then.
+uint64_t next_sleep_us()
+{
+  const uint64_t now_us = rtc_time_us();
+  const uint64_t sleep_us = wake_schedule_next(&wake_schedule, now_us, uS_TO_SLEEP, QUIET_HOURS_START, QUIET_HOURS_END);
+
+  TRACE_POINT("wake.scheduled", "awake_ms=%llu sleep_ms=%llu", (now_us - wake_schedule.arrived_us) / 1000, sleep_us / 1000);
+  return sleep_us;
+}
+
 void goto_sleep(uint64_t micro_seconds)
 {
-  log_d("Going to sleep");
+  TRACE_D("Going to sleep");
+  IO_TRACE_FLUSH();
+  log_memory_high_water();
 
-#ifndef TINYPICO_WAVESHARE_EPD
-  // Isolate/disable GPIO12 on ESP32 (only to reduce power consumption in sleep)
-  rtc_gpio_isolate(GPIO_NUM_12);
-#endif
-  // Isolate/disable GPIO12 on ESP32 (only to reduce power consumption in sleep)
-  esp_sleep_enable_timer_wakeup(uS_TO_SLEEP); // Activate wake-up timer
-  esp_deep_sleep_start();                     // Put ESP32 into deep sleep. Program stops here.
+  Panel::before_sleep(display);
+  esp_sleep_enable_timer_wakeup(micro_seconds); // Activate wake-up timer
+  esp_deep_sleep_start();                       // Put ESP32 into deep sleep. Program stops here.
 }
 
 void log_wakeup_reason()
@@ -127,124 +388,145 @@ void log_wakeup_reason()
   switch (wakeup_reason)
   {
   case ESP_SLEEP_WAKEUP_EXT0:
-    log_d("Wakeup caused by external signal using RTC_IO");
+    TRACE_D("Wakeup caused by external signal using RTC_IO");
     break;
   case ESP_SLEEP_WAKEUP_EXT1:
-    log_d("Wakeup caused by external signal using RTC_CNTL");
+    TRACE_D("Wakeup caused by external signal using RTC_CNTL");
     break;
   case ESP_SLEEP_WAKEUP_TIMER:
-    log_d("Wakeup caused by timer");
+    TRACE_D("Wakeup caused by timer");
     break;
   case ESP_SLEEP_WAKEUP_TOUCHPAD:
-    log_d("Wakeup caused by touchpad");
+    TRACE_D("Wakeup caused by touchpad");
     break;
   case ESP_SLEEP_WAKEUP_ULP:
-    log_d("Wakeup caused by ULP program");
+    TRACE_D("Wakeup caused by ULP program");
     break;
   default:
-    log_d("Wakeup was not caused by deep sleep");
+    TRACE_D("Wakeup was not caused by deep sleep");
     break;
   }
 }
 
-void build_index_for_dir(SdFile *dir)
+void open_index()
 {
-  char dirname[256];
-  SdFile file;
-
-  dir->getName(dirname, sizeof(dirname));
-  log_d("Rebuilding index for %s", dirname);
-
-  dir->rewind();
-  while (true)
+  if (index_file.isOpen())
   {
-    if (!file.openNext(dir, O_RDONLY))
-    {
-      log_d("End reached of %s", dirname);
-      return;
-    }
-
-    if (file.isDir())
-    {
-      log_d("Found sub/sub directory. Skipping.");
-      file.close();
-      continue;
-    }
-
-    if (file.isHidden())
-    {
-      log_d("Found hidden file. Skipping.");
-      file.close();
-      continue;
-    }
-
-    photo_index_list[photo_count++] = {.dir_index = dir->dirIndex(), .file_index = file.dirIndex()};
-    file.close();
-
-    if (photo_count >= MAX_PHOTOS)
-    {
-      log_d("Max photo count of %d reached. Stopping scan.", MAX_PHOTOS);
-      return;
-    }
+    index_file.close();
+  }
+  if (index_file.open("/index.bin", O_RDONLY) == 0)
+  {
+    TRACE_D("Could not open '/index.bin'");
   }
 }
 
-void build_index()
+uint32_t library_signature()
 {
-  next_photo_index = 0;
-  photo_count = 0;
+  arena_region_t *io = &regions[REGION_IO];
+  const uint32_t used = io->used;
+  uint8_t *buffer = arena_take(io, DIR_SCAN_BUFFER_SIZE);
+  const uint32_t signature = buffer != nullptr ? photo_library_signature(&photos_dir, buffer) : 0;
 
-  SdFile file;
-  log_d("Rebuilding /photos index");
+  arena_release(io, used);
+  return signature;
+}
 
-  photos_dir.rewind();
-  while (true)
+// Tells whether a new scan of /photos is needed, called once per wake while
+// no scan is running.
+bool rescan_due()
+{
+  if (++scan_state.idle_wakes >= INDEX_RESCAN_WAKES)
   {
-    if (!file.openNext(&photos_dir, O_RDONLY))
-    {
-      log_d("End reached of /photos");
-      return;
-    }
+    TRACE_D("Rescanning /photos after %u wakes", scan_state.idle_wakes);
+    return true;
+  }
+  if (library_signature() != scan_state.signature)
+  {
+    TRACE_D("/photos changed, rescanning");
+    return true;
+  }
+  return false;
+}
 
-    if (!file.isDir())
-    {
-      log_d("Found non directory in /photos. Skipping.");
-      file.close();
-      continue;
-    }
+void scan_index(uint32_t budget_ms)
+{
+  IoFile new_index;
+  const uint32_t started = millis();
 
-    build_index_for_dir(&file);
-    file.close();
+  if (new_index.open("/~index.bin", O_RDWR | O_CREAT) == 0)
+  {
+    HARD_ERROR("Could not open '/~index.bin'")
+  }
 
-    if (photo_count >= MAX_PHOTOS)
+  arena_region_t *region = &regions[REGION_INDEX_SCAN];
+  const uint32_t used = region->used;
+  IndexBuilder<IoFile> builder(&photos_dir, &new_index, &scan_state, photo_file_extension,
+                               arena_take(region, INDEX_BUILDER_BUFFER_SIZE));
+  if (!scan_state.active)
+  {
+    TRACE_D("Starting new scan of /photos");
+    new_index.truncate(0);
+    if (!builder.start(library_signature()))
     {
-      break;
+      HARD_ERROR("Could not write '/~index.bin'")
     }
   }
+  if (!builder.step([&]() {
+        panel_poll();
+        return millis() - started >= budget_ms;
+      }))
+  {
+    HARD_ERROR("Could not write '/~index.bin'")
+  }
+  new_index.close();
+  arena_release(region, used);
 
-  log_d("Finished rebuilding. Scanned %d photos", photo_count);
+  TRACE_POINT("index.scan", "ms=%lu photos=%u complete=%d", millis() - started, scan_state.count, scan_state.complete);
 }
 
-void shuffle_array(photo_index_t *array, uint16_t size)
+void swap_index()
 {
-  // Initialize randomseed using internal random generation of esp32
-  randomSeed(analogRead(0));
+  IoFile old_index;
+  IoFile new_index;
 
-  uint16_t last = 0;
-  photo_index_t temp = array[last];
-  for (uint16_t i = 0; i < size; i++)
+  TRACE_D("Swapping in new index with %u photos", scan_state.count);
+  index_file.close();
+  if (new_index.open("/~index.bin", O_RDWR) == 0)
+  {
+    HARD_ERROR("Could not open '/~index.bin'")
+  }
+  if (old_index.open("/index.bin", O_RDWR) && old_index.remove() == false)
+  {
+    HARD_ERROR("Could not remove old index file for update")
+  }
+  if (new_index.rename("/index.bin") == false)
   {
-    uint16_t index = random(0, size);
-    array[last] = array[index];
-    last = index;
+    HARD_ERROR("Could not replace old index with new one")
   }
-  array[last] = temp;
+  new_index.close();
+  open_index();
+
+  photo_count = scan_state.count;
+  next_photo_index = 0;
+  scan_state.complete = 0;
+}
+
+void build_index()
+{
+  IO_TRACE_PHASE(IO_PHASE_BUILD_INDEX);
+  TRACE_D("Rebuilding /photos index");
+  scan_state.active = 0;
+  scan_index(UINT32_MAX);
+  swap_index();
+  TRACE_D("Finished rebuilding. Scanned %u photos", photo_count);
 }
 
 void shuffle_index()
 {
-  log_d("Shuffle index...");
-  shuffle_array(photo_index_list, photo_count);
+  TRACE_D("Shuffle index...");
+  // A new seed selects a new permutation of the whole index. The index file
+  // itself is never rewritten for shuffling.
+  shuffle_seed = esp_random();
 }
 
 void open_config()
@@ -255,12 +537,12 @@ void open_config()
   }
   else
   {
-    log_d("/config.bin opened.");
+    TRACE_D("/config.bin opened.");
   }
   config.rewind();
 }
 
-void open_config_tmp(SdFile *config)
+void open_config_tmp(IoFile *config)
 {
   if (config->open("/~config.bin", FILE_WRITE) == 0)
   {
@@ -268,24 +550,27 @@ void open_config_tmp(SdFile *config)
   }
   else
   {
-    log_d("/~config.bin opened.");
+    TRACE_D("/~config.bin opened.");
   }
 }
 
 void update_config()
 {
-  SdFile new_config;
+  IoFile new_config;
 
-  log_d("Updating config...");
+  IO_TRACE_PHASE(IO_PHASE_UPDATE_CONFIG);
+  TRACE_D("Updating config...");
   open_config_tmp(&new_config);
   new_config.truncate(0);
   new_config.rewind();
   new_config.write(config_magic, CONFIG_MAGIC_LEN);
-  new_config.write(photo_index_list, CONFIG_PHOTO_INDEX_LEN);
+  new_config.write(&config_version, CONFIG_VERSION_LEN);
   new_config.write(&photo_count, CONFIG_PHOTO_COUNT_LEN);
   new_config.write(&next_photo_index, CONFIG_NEXT_PHOTO_INDEX_LEN);
+  new_config.write(&shuffle_seed, CONFIG_SHUFFLE_SEED_LEN);
+  new_config.write(&scan_state, CONFIG_SCAN_STATE_LEN);
   new_config.flush();
-  log_d("New config written.");
+  TRACE_D("New config written.");
   if (config.remove() == false) {
     HARD_ERROR("Could not remove old config file for update")
   };
@@ -296,31 +581,56 @@ void update_config()
   }
   new_config.close();
   open_config();
-  log_d("config update complete");
+  TRACE_D("config update complete");
 }
 
 void read_config()
 {
   char magic[CONFIG_MAGIC_LEN];
+  uint16_t version;
 
-  log_d("Reading config...");
+  TRACE_D("Reading config...");
   config.rewind();
   config.read(magic, CONFIG_MAGIC_LEN);
-  config.read(photo_index_list, CONFIG_PHOTO_INDEX_LEN);
+  config.read(&version, CONFIG_VERSION_LEN);
   config.read(&photo_count, CONFIG_PHOTO_COUNT_LEN);
   config.read(&next_photo_index, CONFIG_NEXT_PHOTO_INDEX_LEN);
+  config.read(&shuffle_seed, CONFIG_SHUFFLE_SEED_LEN);
+  config.read(&scan_state, CONFIG_SCAN_STATE_LEN);
+}
+
+bool index_matches_config()
+{
+  uint32_t index_count;
+
+  read_config();
+  open_index();
+  if (!index_file.isOpen() || !read_index_header(&index_file, &index_count))
+  {
+    TRACE_D("No valid index found.");
+    return false;
+  }
+  if (index_count != photo_count)
+  {
+    TRACE_D("Index holds %u photos, config expects %u.", index_count, photo_count);
+    return false;
+  }
+  return true;
 }
 
 void init_config()
 {
   char magic[CONFIG_MAGIC_LEN];
+  uint16_t version = 0;
 
+  IO_TRACE_PHASE(IO_PHASE_INIT_CONFIG);
   open_config();
 
   config.read(magic, CONFIG_MAGIC_LEN);
-  if (strncmp(magic, config_magic, 20) != 0)
+  config.read(&version, CONFIG_VERSION_LEN);
+  if (strncmp(magic, config_magic, 20) != 0 || version != config_version || !index_matches_config())
   {
-    log_d("No valid config found reinitializing it.");
+    TRACE_D("No valid config found reinitializing it.");
     build_index();
     shuffle_index();
     update_config();
@@ -338,7 +648,7 @@ void init_sd()
   while (!sd.begin(sdConfig) && retries > 0)
   {
 #endif
-    log_d("SD initialization error, retrying!");
+    TRACE_D("SD initialization error, retrying!");
     --retries;
     delay(retry_delay);
   }
@@ -348,7 +658,7 @@ void init_sd()
   }
   else
   {
-    log_d("SD Initialized.");
+    TRACE_D("SD Initialized.");
   }
 }
 
@@ -360,112 +670,226 @@ void open_photo_directory()
   }
   else
   {
-    log_d("Directory opened.");
+    TRACE_D("Directory opened.");
+  }
+}
+
+// Sets the time zone and, if it is not set yet or behind, the clock from
+// CLOCK_FILE.
+void load_clock()
+{
+  clock_file_t clock;
+  IoFile file;
+  arena_region_t *io = &regions[REGION_IO];
+  const uint32_t used = io->used;
+  char *text = (char *)arena_take(io, CLOCK_FILE_MAX_SIZE + 1);
+
+  clock.seconds = 0;
+  clock.tz[0] = '\0';
+  if (text != nullptr && file.open(CLOCK_FILE, O_RDONLY))
+  {
+    const int n_bytes = file.read(text, CLOCK_FILE_MAX_SIZE);
+    file.close();
+    text[n_bytes > 0 ? n_bytes : 0] = '\0';
+    if (!parse_clock_file(text, &clock))
+    {
+      TRACE_E("Invalid clock file '%s', ignoring it.", CLOCK_FILE);
+      clock.seconds = 0;
+      clock.tz[0] = '\0';
+    }
+  }
+  setenv("TZ", clock.tz[0] != '\0' ? clock.tz : "UTC0", 1);
+  tzset();
+
+  const uint64_t now_us = rtc_time_us();
+  if (clock_file_applies(&clock, now_us))
+  {
+    struct timeval now = {.tv_sec = (time_t)clock.seconds, .tv_usec = 0};
+
+    settimeofday(&now, nullptr);
+    // The wake was measured on the old time line.
+    wake_schedule_shift(&wake_schedule, (int64_t)(clock.seconds * 1000000 - now_us));
+    TRACE_I("Clock set from '%s'", CLOCK_FILE);
+  }
+  arena_release(io, used);
+}
+
+void load_tone_map()
+{
+  tone_curve_t curve;
+  IoFile file;
+  arena_region_t *io = &regions[REGION_IO];
+  const uint32_t used = io->used;
+  char *text = (char *)arena_take(io, TONE_FILE_MAX_SIZE + 1);
+
+  default_tone_curve(&curve);
+  if (text != nullptr && file.open(Panel::tone_file(), O_RDONLY))
+  {
+    const int n_bytes = file.read(text, TONE_FILE_MAX_SIZE);
+    file.close();
+    text[n_bytes > 0 ? n_bytes : 0] = '\0';
+    if (!parse_tone_curve(text, &curve))
+    {
+      TRACE_E("Invalid tone curve in '%s', using defaults.", Panel::tone_file());
+      default_tone_curve(&curve);
+    }
+    else
+    {
+      TRACE_D("Tone curve loaded from '%s'", Panel::tone_file());
+    }
+  }
+  build_tone_map<Panel>(curve, &tone_map);
+  arena_release(io, used);
+}
+
+void read_and_resample_photo(IoFile *file, photo_geometry_t geometry)
+{
+  const photo_geometry_t panel = {.width = Panel::width, .height = Panel::height};
+  const uint16_t row_bytes = geometry.width / 2;
+  arena_region_t *io = &regions[REGION_IO];
+  const uint32_t used = io->used;
+  uint8_t *buffer = arena_take(io, row_bytes);
+  resample_plan_t plan;
+
+  if (buffer == nullptr)
+  {
+    HARD_ERROR("Photo rows do not fit into the I/O buffer.")
+  }
+
+  TRACE_D("Resampling %dx%d photo to %dx%d", geometry.width, geometry.height, panel.width, panel.height);
+  plan_resample(geometry, panel, PHOTO_FIT, &plan);
+  // Letterboxed photos keep the background around them.
+  const bool covers_panel = plan.dst_width == Panel::width && plan.dst_height == Panel::height;
+  StripRenderer<Panel> renderer(Panel::framebuffer(display), render_strip, &status_bar, !covers_panel);
+  // Palette indices can not be averaged.
+  auto resampler = make_resampler(plan, !Panel::palette, resample_acc, [&renderer](uint16_t x, uint16_t y, uint8_t value) {
+    put_packed_nibble(renderer.row(y), x, tone_map.nibble[value]);
+  });
+  for (uint16_t y = 0; y < geometry.height && !resampler.done(); y++)
+  {
+    if (file->read(buffer, row_bytes) != row_bytes)
+    {
+      TRACE_E("Photo ended early at row %d", y);
+      renderer.fill_from(resampler.next_row(), Panel::white << 4 | Panel::white);
+      break;
+    }
+    resampler.push_row(buffer);
+    panel_poll();
+  }
+  renderer.finish();
+  arena_release(io, used);
+}
+
+// Called when the photo to show is missing or there is none at all. Waiting
+// for the next regular rescan would show the same error on every wake, so a
+// scan of /photos is started or continued right away and swapped in once it
+// is complete. Until then the next wake tries the next photo.
+void recover_photo_error()
+{
+  if (!scan_state.complete)
+  {
+    IO_TRACE_PHASE(IO_PHASE_SCAN_INDEX);
+    scan_index(INDEX_SCAN_BUDGET_MS);
+  }
+  if (scan_state.complete)
+  {
+    swap_index();
+    shuffle_index();
+  }
+  else
+  {
+    next_photo_index = next_photo_index + 1 < photo_count ? next_photo_index + 1 : 0;
   }
+  update_config();
 }
 
 void read_and_display_photo()
 {
-  SdFile dir;
-  SdFile file;
-  const uint16_t width = E_INK_WIDTH / 2;
-  // const uint16_t height = 600;
-
-  uint32_t offset = 0;
-  uint16_t n_bytes;
-  uint8_t buffer[1024];
-  uint16_t x, y;
-  uint16_t i;
-  uint32_t total = 0;
-
-  // for (uint16_t photo_idx = 0; photo_idx < photo_count; photo_idx++)
-  // {
-  //   uint16_t dir_index = (photo_index_list[photo_idx] & 0xffff0000) >> 16;
-  //   uint16_t file_index = (photo_index_list[photo_idx] & 0x0000ffff);
-  //   log_d("Opening id : [%d] %d, %d", photo_idx, dir_index, file_index);
-
-  //   if (dir.open(&photos_dir, dir_index, 0) == 0)
-  //   {
-  //     log_d("Could not open picture file directory.");
-  //     display->println("Could not open picture file directory.");
-  //     display->display();
-  //     invalidate_config();
-  //     goto_sleep(uS_TO_SLEEP);
-  //     return;
-  //   }
-
-  //   if (!file.open(&dir, file_index, O_RDONLY))
-  //   {
-  //     log_d("Id [%d] %d %d could not be opened!", photo_idx, dir_index, file_index);
-  //   }
-  //   else
-  //   {
-  //     file.close();
-  //   }
-  //   dir.close();
-  // }
-
-  photo_index_t photo_index = photo_index_list[next_photo_index];
+  IoFile dir;
+  IoFile file;
+
+  IO_TRACE_PHASE(IO_PHASE_DISPLAY_PHOTO);
+
+  photo_index_t photo_index;
+
+  if (photo_count == 0)
+  {
+    PHOTO_ERROR("No photos found.")
+  }
+
+  if (!read_index_entry(&index_file, shuffle_position(next_photo_index, photo_count, shuffle_seed), index_page, &photo_index))
+  {
+    PHOTO_ERROR("Could not read photo index.")
+  }
 
   if (dir.open(&photos_dir, photo_index.dir_index, 0) == 0)
   {
-    HARD_ERROR("Could not open picture file directory.")
+    PHOTO_ERROR("Could not open picture file directory.")
   }
 
   if (!file.open(&dir, photo_index.file_index, O_RDONLY))
   {
-    HARD_ERROR("Could not open picture file.");
+    PHOTO_ERROR("Could not open picture file.")
   }
 
-  memset(&buffer, 0, 1024);
-  n_bytes = file.read(&buffer, 1024);
-  while (n_bytes > 0)
+  photo_geometry_t geometry;
+  if (photo_geometry_for_size(file.fileSize(), &geometry) && (geometry.width != Panel::width || geometry.height != Panel::height))
   {
-    for (i = 0; i < n_bytes; i++)
-    {
-      y = (offset + i) / width;
-      x = ((offset + i) % width) * 2;
-#ifdef TINYPICO_WAVESHARE_EPD
-      display->writePixel(x, y, buffer[i] >> 4 & 0x0f);
-      display->writePixel(x + 1, y, buffer[i] & 0x0f);
-#elif ARDUINO_INKPLATECOLOR
-      display->drawPixel(x, y, (buffer[i] >> 4));
-      display->drawPixel(x + 1, y, (buffer[i] & 0x0f));
-#else
-      display->drawPixel(x, y, (buffer[i] >> 4) >> 1);
-      display->drawPixel(x + 1, y, (buffer[i] & 0x0f) >> 1);
-#endif
-    }
-    offset += n_bytes;
-    total += n_bytes;
-    n_bytes = file.read(&buffer, 1024);
+    read_and_resample_photo(&file, geometry);
+    file.close();
+    dir.close();
+    return;
+  }
+
+  StripRenderer<Panel> renderer(Panel::framebuffer(display), render_strip, &status_bar, false);
+  if (!ingest_photo(&file, &renderer, tone_map.identity ? nullptr : tone_map.pair, panel_poll))
+  {
+    TRACE_E("Photo file ended early.");
   }
-  log_d("Read image bytes: %d", total);
   file.close();
   dir.close();
 }
 
 void setup()
 {
+  // Taken first, wakes are measured against their schedule with it.
+  const uint64_t arrived_us = rtc_time_us();
+
+#if TRACE_LEVEL > TRACE_LEVEL_NONE
   Serial.begin(115200);
   while (!Serial)
   {
     delay(1);
   }
+#endif
 
   log_wakeup_reason();
+  arrive_on_schedule(arrived_us);
+
+  if (!reserve_memory())
+  {
+    goto_sleep(next_sleep_us());
+    return;
+  }
+  void *display_storage = arena_take_all(&regions[REGION_DISPLAY]);
 
 #ifndef TINYPICO_WAVESHARE_EPD
 #ifndef ARDUINO_INKPLATECOLOR
-  display = new (displayObjStorage) Inkplate(INKPLATE_3BIT);
+  display = new (display_storage) Inkplate(INKPLATE_3BIT);
 #else
-  display = new (displayObjStorage) Inkplate();
+  display = new (display_storage) Inkplate();
+#endif
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+  const uint32_t psram_before_begin = ESP.getFreePsram();
+  const uint32_t heap_before_begin = ESP.getFreeHeap();
 #endif
 #if defined(USE_INKPLATE_LIGHTMODE) && !defined(ARDUINO_INKPLATE_COLOR)
   display->begin(true);
 #else
   display->begin();
 #endif
+  TRACE_I("Inkplate library: %u bytes psram, %u bytes heap", psram_before_begin - ESP.getFreePsram(),
+          heap_before_begin - ESP.getFreeHeap());
   display->setTextSize(3);
   display->setTextColor(0, 7);
   display->setTextWrap(true);
@@ -477,48 +901,81 @@ void setup()
   pinMode(APA_102_PWR, OUTPUT);
   digitalWrite(APA_102_PWR, 0);
 
-  display = new (displayObjStorage) Adafruit_ACEP_PSRAM(E_INK_WIDTH, E_INK_HEIGHT, EPD_DC, EPD_RESET, EPD_CS, EPD_BUSY, &vspi_class);
-  display->begin();
+  display = new (display_storage) Adafruit_ACEP_PSRAM(E_INK_WIDTH, E_INK_HEIGHT, EPD_DC, EPD_RESET, EPD_CS, EPD_BUSY,
+                                                      &vspi_class, arena_take_all(&regions[REGION_FRAMEBUFFER]),
+                                                      arena_take_all(&regions[REGION_DMA]));
+  // The reset is part of the power up, see AcepPanel::power_up().
+  display->begin(false);
   display->clearBuffer();
   display->setTextSize(3);
   display->setTextColor(ACEP_COLOR_BLACK, ACEP_COLOR_WHITE);
   display->setTextWrap(true);
 #endif
+  Panel::power_up(display);
   // Check PSRAM is working
-  log_d("Total heap: %d", ESP.getHeapSize());
-  log_d("Free heap: %d", ESP.getFreeHeap());
-  log_d("Total PSRAM: %d", ESP.getPsramSize());
-  log_d("Free PSRAM: %d", ESP.getFreePsram());
-
-  // Allocate psram buffer for photoindex;
-  photo_index_list = (photo_index_t *)ps_malloc(CONFIG_PHOTO_INDEX_LEN);
-  if (photo_index_list == nullptr)
-  {
-    HARD_ERROR("Allocation of photo_index memory failed!");
-  }
+  TRACE_D("Total heap: %d", ESP.getHeapSize());
+  TRACE_D("Free heap: %d", ESP.getFreeHeap());
+  TRACE_D("Total PSRAM: %d", ESP.getPsramSize());
+  TRACE_D("Free PSRAM: %d", ESP.getFreePsram());
 
+  TRACE_SPAN_BEGIN(sd_init);
   init_sd();
   open_photo_directory();
+  load_clock();
+  load_tone_map();
+  TRACE_SPAN_END(sd_init);
+  panel_poll();
+
+  TRACE_SPAN_BEGIN(config_init);
   init_config();
   read_config();
+  TRACE_SPAN_END(config_init);
+  panel_poll();
+
+  // The status bar is drawn together with the photo, so it is built first.
+  build_status_bar(next_photo_index);
 
+  TRACE_SPAN_BEGIN(photo_render);
   read_and_display_photo();
-  if (next_photo_index >= photo_count - 1)
+  TRACE_SPAN_END(photo_render);
+  TRACE_POINT("wake.rendered", "ms=%lu photo=%u count=%u", millis(), next_photo_index, photo_count);
+
+  if (scan_state.active || (!scan_state.complete && rescan_due()))
+  {
+    // The index is rebuilt in the background, a bounded slice per wake.
+    IO_TRACE_PHASE(IO_PHASE_SCAN_INDEX);
+    TRACE_SPAN_BEGIN(index_scan);
+    scan_index(INDEX_SCAN_BUDGET_MS);
+    TRACE_SPAN_END(index_scan);
+  }
+  if (next_photo_index + 1 >= photo_count)
   {
     // Reshuffle and reset for next run needed
-    log_d("End of Photos reached. Reindexing and Reshuffling...");
-    build_index();
+    TRACE_D("End of Photos reached. Reshuffling...");
+    if (scan_state.complete)
+    {
+      swap_index();
+    }
+    else
+    {
+      TRACE_D("New index is not complete yet. Keeping the old one.");
+    }
     shuffle_index();
+    next_photo_index = 0;
   }
   else
   {
     ++next_photo_index;
   }
+  TRACE_SPAN_BEGIN(config_update);
   update_config();
-  check_battery();
+  TRACE_SPAN_END(config_update);
 
+  TRACE_SPAN_BEGIN(panel_refresh);
   display->display();
-  goto_sleep(uS_TO_SLEEP);
+  TRACE_SPAN_END(panel_refresh);
+  TRACE_POINT("wake.done", "ms=%lu", millis());
+  goto_sleep(next_sleep_us());
 }
 
 void loop()
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+
+// Overlay compositor for the status bar.
+//
+// Sprites are placed into an overlay first and then blitted directly into a
+// packed 4 bit per pixel framebuffer (even pixels in the high nibble), as
+// used by all supported panels. Each run of ink is written as a span, which
+// keeps the cost independent of the size the sprites are drawn at.
+
+// Every sprite pixel is drawn as a square of OVERLAY_SCALE panel pixels.
+#define OVERLAY_SCALE 3
+#define OVERLAY_MAX_ITEMS 32
+// Empty sprite pixels between two glyphs of a text.
+#define OVERLAY_GLYPH_SPACING 1
+
+typedef struct sprite_span
+{
+  uint8_t x;
+  uint8_t length;
+} sprite_span_t;
+
+typedef struct sprite
+{
+  uint8_t width;
+  uint8_t height;
+  // Number of spans in each row.
+  const uint8_t *rows;
+  // Spans of all rows, one row after the other.
+  const sprite_span_t *spans;
+} sprite_t;
+
+typedef struct overlay_item
+{
+  const sprite_t *sprite;
+  uint16_t x;
+  uint16_t y;
+} overlay_item_t;
+
+typedef struct overlay
+{
+  uint16_t bar_y;
+  uint16_t bar_height;
+  uint8_t ink;
+  uint8_t paper;
+  uint8_t count;
+  overlay_item_t items[OVERLAY_MAX_ITEMS];
+} overlay_t;
+
+// Fills len pixels starting at x within a packed 4 bit row.
+static ALWAYS_INLINE void fill_span_4bpp(uint8_t *row, uint16_t x, uint16_t len, uint8_t color)
+{
+  if (len == 0)
+  {
+    return;
+  }
+  if (x & 1)
+  {
+    row[x >> 1] = (row[x >> 1] & 0xf0) | color;
+    ++x;
+    --len;
+  }
+  memset(row + (x >> 1), color * 0x11, len >> 1);
+  if (len & 1)
+  {
+    const uint16_t last = x + len - 1;
+    row[last >> 1] = (row[last >> 1] & 0x0f) | (color << 4);
+  }
+}
+
+inline void overlay_begin_bar(overlay_t *overlay, uint16_t y, uint16_t height, uint8_t ink, uint8_t paper)
+{
+  overlay->bar_y = y;
+  overlay->bar_height = height;
+  overlay->ink = ink;
+  overlay->paper = paper;
+  overlay->count = 0;
+}
+
+// Places a sprite with its top left corner at x, y. Returns the x coordinate
+// right of it.
+inline uint16_t overlay_add_sprite(overlay_t *overlay, const sprite_t *sprite, uint16_t x, uint16_t y)
+{
+  if (overlay->count < OVERLAY_MAX_ITEMS)
+  {
+    overlay->items[overlay->count++] = {.sprite = sprite, .x = x, .y = y};
+  }
+  return x + sprite->width * OVERLAY_SCALE;
+}
+
+// Draws all rows of the overlay within [y_begin, y_end). framebuffer points
+// to the start of row y_begin, stride is the size of a row in bytes.
+inline void overlay_blit(const overlay_t *overlay, uint8_t *framebuffer, uint16_t stride, uint16_t width,
+                         uint16_t y_begin, uint16_t y_end)
+{
+  const uint16_t bar_end = overlay->bar_y + overlay->bar_height;
+  for (uint16_t y = overlay->bar_y > y_begin ? overlay->bar_y : y_begin; y < bar_end && y < y_end; y++)
+  {
+    fill_span_4bpp(framebuffer + (y - y_begin) * stride, 0, width, overlay->paper);
+  }
+
+  for (uint8_t i = 0; i < overlay->count; i++)
+  {
+    const overlay_item_t &item = overlay->items[i];
+    const sprite_span_t *span = item.sprite->spans;
+
+    for (uint8_t row = 0; row < item.sprite->height; row++)
+    {
+      const sprite_span_t *row_end = span + item.sprite->rows[row];
+      for (uint8_t dy = 0; dy < OVERLAY_SCALE; dy++)
+      {
+        const uint16_t y = item.y + row * OVERLAY_SCALE + dy;
+        if (y < y_begin || y >= y_end)
+        {
+          continue;
+        }
+        uint8_t *line = framebuffer + (y - y_begin) * stride;
+        for (const sprite_span_t *s = span; s < row_end; s++)
+        {
+          const uint16_t x = item.x + s->x * OVERLAY_SCALE;
+          if (x < width)
+          {
+            const uint16_t len = s->length * OVERLAY_SCALE;
+            fill_span_4bpp(line, x, x + len > width ? width - x : len, overlay->ink);
+          }
+        }
+      }
+      span = row_end;
+    }
+  }
+}
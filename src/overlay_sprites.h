@@ -0,0 +1,131 @@
+#pragma once
+
+#include "overlay.h"
+
+// Pre-rasterized overlay sprites generated from a 5x7 pixel font. Every row
+// of a sprite is stored as its horizontal runs of ink, so blitting a sprite
+// only needs a span fill per run, independent of the scale it is drawn at.
+
+const uint8_t sprite_digit_0_rows[] = {1, 2, 2, 3, 2, 2, 1};
+const sprite_span_t sprite_digit_0_spans[] = {{1, 3}, {0, 1}, {4, 1}, {0, 1}, {3, 2}, {0, 1}, {2, 1}, {4, 1}, {0, 2}, {4, 1}, {0, 1}, {4, 1}, {1, 3}};
+const sprite_t sprite_digit_0 = {5, 7, sprite_digit_0_rows, sprite_digit_0_spans};
+
+const uint8_t sprite_digit_1_rows[] = {1, 1, 1, 1, 1, 1, 1};
+const sprite_span_t sprite_digit_1_spans[] = {{2, 1}, {1, 2}, {2, 1}, {2, 1}, {2, 1}, {2, 1}, {1, 3}};
+const sprite_t sprite_digit_1 = {5, 7, sprite_digit_1_rows, sprite_digit_1_spans};
+
+const uint8_t sprite_digit_2_rows[] = {1, 2, 1, 1, 1, 1, 1};
+const sprite_span_t sprite_digit_2_spans[] = {{1, 3}, {0, 1}, {4, 1}, {4, 1}, {3, 1}, {2, 1}, {1, 1}, {0, 5}};
+const sprite_t sprite_digit_2 = {5, 7, sprite_digit_2_rows, sprite_digit_2_spans};
+
+const uint8_t sprite_digit_3_rows[] = {1, 1, 1, 1, 1, 2, 1};
+const sprite_span_t sprite_digit_3_spans[] = {{0, 5}, {3, 1}, {2, 1}, {3, 1}, {4, 1}, {0, 1}, {4, 1}, {1, 3}};
+const sprite_t sprite_digit_3 = {5, 7, sprite_digit_3_rows, sprite_digit_3_spans};
+
+const uint8_t sprite_digit_4_rows[] = {1, 1, 2, 2, 1, 1, 1};
+const sprite_span_t sprite_digit_4_spans[] = {{3, 1}, {2, 2}, {1, 1}, {3, 1}, {0, 1}, {3, 1}, {0, 5}, {3, 1}, {3, 1}};
+const sprite_t sprite_digit_4 = {5, 7, sprite_digit_4_rows, sprite_digit_4_spans};
+
+const uint8_t sprite_digit_5_rows[] = {1, 1, 1, 1, 1, 2, 1};
+const sprite_span_t sprite_digit_5_spans[] = {{0, 5}, {0, 1}, {0, 4}, {4, 1}, {4, 1}, {0, 1}, {4, 1}, {1, 3}};
+const sprite_t sprite_digit_5 = {5, 7, sprite_digit_5_rows, sprite_digit_5_spans};
+
+const uint8_t sprite_digit_6_rows[] = {1, 1, 1, 1, 2, 2, 1};
+const sprite_span_t sprite_digit_6_spans[] = {{2, 2}, {1, 1}, {0, 1}, {0, 4}, {0, 1}, {4, 1}, {0, 1}, {4, 1}, {1, 3}};
+const sprite_t sprite_digit_6 = {5, 7, sprite_digit_6_rows, sprite_digit_6_spans};
+
+const uint8_t sprite_digit_7_rows[] = {1, 1, 1, 1, 1, 1, 1};
+const sprite_span_t sprite_digit_7_spans[] = {{0, 5}, {4, 1}, {3, 1}, {2, 1}, {1, 1}, {1, 1}, {1, 1}};
+const sprite_t sprite_digit_7 = {5, 7, sprite_digit_7_rows, sprite_digit_7_spans};
+
+const uint8_t sprite_digit_8_rows[] = {1, 2, 2, 1, 2, 2, 1};
+const sprite_span_t sprite_digit_8_spans[] = {{1, 3}, {0, 1}, {4, 1}, {0, 1}, {4, 1}, {1, 3}, {0, 1}, {4, 1}, {0, 1}, {4, 1}, {1, 3}};
+const sprite_t sprite_digit_8 = {5, 7, sprite_digit_8_rows, sprite_digit_8_spans};
+
+const uint8_t sprite_digit_9_rows[] = {1, 2, 2, 1, 1, 1, 1};
+const sprite_span_t sprite_digit_9_spans[] = {{1, 3}, {0, 1}, {4, 1}, {0, 1}, {4, 1}, {1, 4}, {4, 1}, {3, 1}, {1, 2}};
+const sprite_t sprite_digit_9 = {5, 7, sprite_digit_9_rows, sprite_digit_9_spans};
+
+const uint8_t sprite_period_rows[] = {0, 0, 0, 0, 0, 1, 1};
+const sprite_span_t sprite_period_spans[] = {{1, 2}, {1, 2}};
+const sprite_t sprite_period = {5, 7, sprite_period_rows, sprite_period_spans};
+
+const uint8_t sprite_slash_rows[] = {0, 1, 1, 1, 1, 1, 0};
+const sprite_span_t sprite_slash_spans[] = {{4, 1}, {3, 1}, {2, 1}, {1, 1}, {0, 1}};
+const sprite_t sprite_slash = {5, 7, sprite_slash_rows, sprite_slash_spans};
+
+const uint8_t sprite_colon_rows[] = {0, 1, 1, 0, 1, 1, 0};
+const sprite_span_t sprite_colon_spans[] = {{1, 2}, {1, 2}, {1, 2}, {1, 2}};
+const sprite_t sprite_colon = {5, 7, sprite_colon_rows, sprite_colon_spans};
+
+const uint8_t sprite_volt_rows[] = {2, 2, 2, 2, 2, 2, 1};
+const sprite_span_t sprite_volt_spans[] = {{0, 1}, {4, 1}, {0, 1}, {4, 1}, {0, 1}, {4, 1}, {0, 1}, {4, 1}, {0, 1}, {4, 1}, {1, 1}, {3, 1}, {2, 1}};
+const sprite_t sprite_volt = {5, 7, sprite_volt_rows, sprite_volt_spans};
+
+const uint8_t sprite_space_rows[] = {0, 0, 0, 0, 0, 0, 0};
+const sprite_span_t sprite_space_spans[] = {{0, 0}};
+const sprite_t sprite_space = {5, 7, sprite_space_rows, sprite_space_spans};
+
+const uint8_t sprite_battery_rows[] = {1, 2, 2, 2, 2, 2, 1};
+const sprite_span_t sprite_battery_spans[] = {{0, 9}, {0, 1}, {8, 1}, {0, 1}, {8, 3}, {0, 1}, {8, 3}, {0, 1}, {8, 3}, {0, 1}, {8, 1}, {0, 9}};
+const sprite_t sprite_battery = {11, 7, sprite_battery_rows, sprite_battery_spans};
+
+const uint8_t sprite_label_low_rows[] = {4, 5, 5, 6, 6, 6, 4};
+const sprite_span_t sprite_label_low_spans[] = {{0, 1}, {7, 3}, {12, 1}, {16, 1}, {0, 1}, {6, 1}, {10, 1}, {12, 1}, {16, 1}, {0, 1}, {6, 1}, {10, 1}, {12, 1}, {16, 1}, {0, 1}, {6, 1}, {10, 1}, {12, 1}, {14, 1}, {16, 1}, {0, 1}, {6, 1}, {10, 1}, {12, 1}, {14, 1}, {16, 1}, {0, 1}, {6, 1}, {10, 1}, {12, 1}, {14, 1}, {16, 1}, {0, 5}, {7, 3}, {13, 1}, {15, 1}};
+const sprite_t sprite_label_low = {17, 7, sprite_label_low_rows, sprite_label_low_spans};
+
+inline const sprite_t *glyph_sprite(char c)
+{
+  switch (c)
+  {
+  case '0':
+    return &sprite_digit_0;
+  case '1':
+    return &sprite_digit_1;
+  case '2':
+    return &sprite_digit_2;
+  case '3':
+    return &sprite_digit_3;
+  case '4':
+    return &sprite_digit_4;
+  case '5':
+    return &sprite_digit_5;
+  case '6':
+    return &sprite_digit_6;
+  case '7':
+    return &sprite_digit_7;
+  case '8':
+    return &sprite_digit_8;
+  case '9':
+    return &sprite_digit_9;
+  case '.':
+    return &sprite_period;
+  case '/':
+    return &sprite_slash;
+  case ':':
+    return &sprite_colon;
+  case 'V':
+    return &sprite_volt;
+  default:
+    return &sprite_space;
+  }
+}
+
+inline uint16_t overlay_text_width(const char *text)
+{
+  uint16_t width = 0;
+  for (; *text != '\0'; text++)
+  {
+    width += (glyph_sprite(*text)->width + OVERLAY_GLYPH_SPACING) * OVERLAY_SCALE;
+  }
+  return width;
+}
+
+inline uint16_t overlay_add_text(overlay_t *overlay, const char *text, uint16_t x, uint16_t y)
+{
+  for (; *text != '\0'; text++)
+  {
+    x = overlay_add_sprite(overlay, glyph_sprite(*text), x, y) + OVERLAY_GLYPH_SPACING * OVERLAY_SCALE;
+  }
+  return x;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+
+#ifdef ARDUINO
+#include "driver/rtc_io.h"
+#endif
+
+// Compile time description of the supported panels.
+//
+// Every backend describes the pixel format of a panel: its resolution,
+// whether pixels are palette indices or gray levels, how 4 bit photo values
+// are converted to it, the colors used for overlays and blank areas and the
+// name of its tone curve calibration file. All panels share the
+// same native buffer layout: 4 bits per pixel, two pixels per byte with the
+// left one in the high nibble.
+//
+// The conversion is folded into the tone map tables built at boot (see
+// tone_map.h). The device hooks take the display driver: access to its
+// framebuffer, starting and advancing the power up and preparing for deep
+// sleep, which is called without a driver, if none was created. They are only
+// available on the device.
+
+#ifdef ARDUINO
+// Device hooks of the Inkplates. The Inkplate library draws into its own
+// framebuffer and powers the panel up and down within display().
+struct InkplateDevice
+{
+  template <typename Display>
+  static uint8_t *framebuffer(Display *display)
+  {
+    return display->DMemory4Bit;
+  }
+
+  template <typename Display>
+  static void power_up(Display *)
+  {
+  }
+
+  template <typename Display>
+  static void poll(Display *)
+  {
+  }
+
+  template <typename Display>
+  static void before_sleep(Display *)
+  {
+    // Isolate/disable GPIO12 on ESP32 (only to reduce power consumption in sleep)
+    rtc_gpio_isolate(GPIO_NUM_12);
+  }
+};
+#else
+struct InkplateDevice
+{
+};
+#endif
+
+// Inkplate 6 and 10 in 3 bit grayscale mode. Photos carry 4 bit gray levels.
+template <uint16_t WIDTH, uint16_t HEIGHT>
+struct InkplateGrayPanel : InkplateDevice
+{
+  static const uint16_t width = WIDTH;
+  static const uint16_t height = HEIGHT;
+  static const bool palette = false;
+  static const uint8_t overlay_ink = 7;
+  static const uint8_t overlay_paper = 0;
+  // Fills areas without photo data.
+  static const uint8_t white = 7;
+
+  static ALWAYS_INLINE uint8_t convert(uint8_t value)
+  {
+    return value >> 1;
+  }
+
+  static const char *tone_file()
+  {
+    return "/tone_gray.txt";
+  }
+
+};
+
+// Inkplate 6COLOR. Photos carry palette indices in the panel's color order.
+struct InkplateColorPanel : InkplateDevice
+{
+  static const uint16_t width = 600;
+  static const uint16_t height = 448;
+  static const bool palette = true;
+  // INKPLATE_WHITE and INKPLATE_BLACK
+  static const uint8_t overlay_ink = 1;
+  static const uint8_t overlay_paper = 0;
+  static const uint8_t white = 1;
+
+  static ALWAYS_INLINE uint8_t convert(uint8_t value)
+  {
+    return value;
+  }
+
+  static const char *tone_file()
+  {
+    return "/tone_color.txt";
+  }
+
+};
+
+// Waveshare 5.65" 7 color ACEP driven by a TinyPICO. Photos carry palette
+// indices in the panel's color order.
+struct AcepPanel
+{
+  static const uint16_t width = 600;
+  static const uint16_t height = 448;
+  static const bool palette = true;
+  // ACEP_COLOR_WHITE and ACEP_COLOR_BLACK
+  static const uint8_t overlay_ink = 1;
+  static const uint8_t overlay_paper = 0;
+  static const uint8_t white = 1;
+
+  static ALWAYS_INLINE uint8_t convert(uint8_t value)
+  {
+    return value;
+  }
+
+  static const char *tone_file()
+  {
+    return "/tone_acep.txt";
+  }
+
+#ifdef ARDUINO
+  template <typename Display>
+  static uint8_t *framebuffer(Display *display)
+  {
+    return display->getFramebuffer();
+  }
+
+  // The reset and power up run in the background while the photo is read.
+  template <typename Display>
+  static void power_up(Display *display)
+  {
+    display->startPowerUp();
+  }
+
+  template <typename Display>
+  static void poll(Display *display)
+  {
+    display->poll();
+  }
+
+  template <typename Display>
+  static void before_sleep(Display *display)
+  {
+    // The driver keeps the SPI bus for DMA during the whole wake.
+    if (display != nullptr)
+    {
+      display->endBulk();
+    }
+  }
+#endif
+};
+
+template <typename Panel>
+struct PanelLayout
+{
+  // Bytes per row in the native buffer layout.
+  static const uint32_t stride = Panel::width / 2;
+  static const uint32_t size = stride * Panel::height;
+};
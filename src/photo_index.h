@@ -0,0 +1,223 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+
+// Paged on-SD photo index.
+//
+// The index file consists of fixed size pages. Page 0 holds the header, every
+// following page holds INDEX_ENTRIES_PER_PAGE photo entries. Displaying a photo
+// therefore only needs the page containing the requested entry, independent of
+// the size of the library.
+//
+// The file is templated on the file type, which needs to provide
+// seekSet(), read(), write() and sync() with the semantics of SdFat's SdFile.
+// This allows to use the same code on the host for benchmarking.
+
+typedef struct photo_index
+{
+  uint16_t dir_index;
+  uint16_t file_index;
+} photo_index_t;
+
+#define INDEX_PAGE_SIZE 512
+#define INDEX_ENTRIES_PER_PAGE (INDEX_PAGE_SIZE / sizeof(photo_index_t))
+#define INDEX_VERSION 1
+// 64MB of index. Sub directories and files are addressed by their 16 bit
+// directory index, so this is not a limit in practice.
+#define MAX_PHOTOS (1UL << 24)
+// Rounds of the feistel network used to shuffle the index.
+#define SHUFFLE_ROUNDS 4
+
+const char index_magic[16] = "PHOTOFRAME IDX";
+
+typedef struct index_header
+{
+  char magic[16];
+  uint32_t version;
+  uint32_t photo_count;
+} index_header_t;
+
+static ALWAYS_INLINE uint32_t index_page_offset(uint32_t position)
+{
+  return (position / INDEX_ENTRIES_PER_PAGE + 1) * INDEX_PAGE_SIZE;
+}
+
+template <typename File>
+bool read_index_header(File *file, uint32_t *photo_count)
+{
+  index_header_t header;
+
+  if (!file->seekSet(0) || file->read(&header, sizeof(header)) != sizeof(header))
+  {
+    return false;
+  }
+  if (strncmp(header.magic, index_magic, sizeof(index_magic)) != 0 || header.version != INDEX_VERSION)
+  {
+    return false;
+  }
+
+  *photo_count = header.photo_count;
+  return true;
+}
+
+// Reads the page containing the entry at position into page and extracts the
+// entry from it. page must hold at least INDEX_ENTRIES_PER_PAGE entries.
+template <typename File>
+bool read_index_entry(File *file, uint32_t position, photo_index_t *page, photo_index_t *entry)
+{
+  if (!file->seekSet(index_page_offset(position)))
+  {
+    return false;
+  }
+
+  const int n_bytes = file->read(page, INDEX_PAGE_SIZE);
+  const uint16_t slot = position % INDEX_ENTRIES_PER_PAGE;
+  if (n_bytes < (int)((slot + 1) * sizeof(photo_index_t)))
+  {
+    return false;
+  }
+
+  *entry = page[slot];
+  return true;
+}
+
+// Sequentially writes a new index file page by page. The header is written
+// with a photo count of zero first and only updated once finish() is called,
+// so an interrupted build never looks like a valid index. Building can be
+// suspended and later resumed from the number of entries written so far.
+template <typename File>
+class PhotoIndexWriter
+{
+public:
+  // page holds INDEX_ENTRIES_PER_PAGE entries, it is also used to write the
+  // header.
+  PhotoIndexWriter(File *file, photo_index_t *page) : file(file), page(page), count(0), fill(0) {}
+
+  bool begin()
+  {
+    count = 0;
+    fill = 0;
+    return file->seekSet(0) && write_header();
+  }
+
+  // Continues an index, which already holds entries entries. A partially
+  // filled last page is read back.
+  bool resume(uint32_t entries)
+  {
+    count = entries;
+    fill = entries % INDEX_ENTRIES_PER_PAGE;
+    if (fill == 0)
+    {
+      return true;
+    }
+    const int n_bytes = fill * sizeof(photo_index_t);
+    return file->seekSet(index_page_offset(entries - fill)) && file->read(page, n_bytes) == n_bytes;
+  }
+
+  bool append(const photo_index_t &entry)
+  {
+    page[fill++] = entry;
+    ++count;
+    if (fill == INDEX_ENTRIES_PER_PAGE)
+    {
+      if (!write_page())
+      {
+        return false;
+      }
+      fill = 0;
+    }
+    return true;
+  }
+
+  // Writes out all entries, without marking the index as complete.
+  bool suspend()
+  {
+    return (fill == 0 || write_page()) && file->sync();
+  }
+
+  bool finish()
+  {
+    if (fill > 0 && !write_page())
+    {
+      return false;
+    }
+    return file->seekSet(0) && write_header() && file->sync();
+  }
+
+  uint32_t size() const
+  {
+    return count;
+  }
+
+private:
+  // Writes the header through page, so there must not be pending entries.
+  bool write_header()
+  {
+    index_header_t header;
+
+    memset(page, 0, INDEX_PAGE_SIZE);
+    memcpy(header.magic, index_magic, sizeof(index_magic));
+    header.version = INDEX_VERSION;
+    header.photo_count = count;
+    memcpy(page, &header, sizeof(header));
+    return file->write(page, INDEX_PAGE_SIZE) == INDEX_PAGE_SIZE;
+  }
+
+  bool write_page()
+  {
+    const uint32_t n_bytes = fill * sizeof(photo_index_t);
+    return file->seekSet(index_page_offset(count - fill)) && file->write(page, n_bytes) == n_bytes;
+  }
+
+  File *file;
+  photo_index_t *page;
+  uint32_t count;
+  uint16_t fill;
+};
+
+static ALWAYS_INLINE uint32_t shuffle_round(uint32_t value, uint32_t key)
+{
+  value ^= key;
+  value *= 0x9E3779B1;
+  value ^= value >> 15;
+  value *= 0x85EBCA77;
+  value ^= value >> 13;
+  return value;
+}
+
+// Maps a cursor in [0, count) to a position in [0, count) using a keyed
+// bijection. Walking the cursor from 0 to count - 1 visits every photo exactly
+// once in a random order determined by seed, without the need to keep or
+// rewrite a shuffled copy of the index.
+//
+// A balanced feistel network permutes the smallest even bit width covering
+// count. Results outside of the range are fed back in (cycle walking), which
+// takes less than four iterations on average.
+inline uint32_t shuffle_position(uint32_t cursor, uint32_t count, uint32_t seed)
+{
+  uint8_t half_bits = 1;
+  while ((1ULL << (2 * half_bits)) < count)
+  {
+    ++half_bits;
+  }
+  const uint32_t half_mask = (1UL << half_bits) - 1;
+
+  uint32_t value = cursor;
+  do
+  {
+    uint32_t left = value >> half_bits;
+    uint32_t right = value & half_mask;
+    for (uint8_t round = 0; round < SHUFFLE_ROUNDS; round++)
+    {
+      const uint32_t next = left ^ (shuffle_round(right, seed + round) & half_mask);
+      left = right;
+      right = next;
+    }
+    value = (left << half_bits) | right;
+  } while (value >= count);
+
+  return value;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+
+// Quantization of colors to photo values.
+//
+// Shared by the firmware and the host converter (tools/photo_convert.cpp), so
+// both agree on how levels are rounded and how pixels are packed. Photo values
+// are 4 bits: gray levels from 0 (black) to 15 (white) for grayscale panels
+// and palette indices in the panel's color order for color panels.
+
+#define QUANTIZE_LEVELS 16
+
+typedef struct palette_color
+{
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+} palette_color_t;
+
+// Shared color order of the Inkplate 6COLOR and the ACEP panel.
+const palette_color_t seven_color_palette[7] = {
+    {0, 0, 0},       // Black
+    {255, 255, 255}, // White
+    {0, 255, 0},     // Green
+    {0, 0, 255},     // Blue
+    {255, 0, 0},     // Red
+    {255, 255, 0},   // Yellow
+    {255, 128, 0},   // Orange
+};
+
+// Maps a level in [0, 1] to a photo value.
+static ALWAYS_INLINE uint8_t quantize_level(float level)
+{
+  if (level <= 0.0f)
+  {
+    return 0;
+  }
+  if (level >= 1.0f)
+  {
+    return QUANTIZE_LEVELS - 1;
+  }
+  return (uint8_t)(level * (QUANTIZE_LEVELS - 1) + 0.5f);
+}
+
+// 8 bit gray to photo value and back.
+static ALWAYS_INLINE uint8_t quantize_gray(uint8_t gray)
+{
+  return (gray * (QUANTIZE_LEVELS - 1) + 127) / 255;
+}
+
+static ALWAYS_INLINE uint8_t gray_of_level(uint8_t level)
+{
+  return level * (255 / (QUANTIZE_LEVELS - 1));
+}
+
+// ITU-R BT.601 luma in 8 bit fixed point.
+static ALWAYS_INLINE uint8_t luma(uint8_t r, uint8_t g, uint8_t b)
+{
+  return (77 * r + 150 * g + 29 * b + 128) >> 8;
+}
+
+inline uint8_t nearest_palette_index(int16_t r, int16_t g, int16_t b, const palette_color_t *palette, uint8_t count)
+{
+  uint8_t best = 0;
+  uint32_t best_distance = UINT32_MAX;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    const int32_t dr = r - palette[i].r;
+    const int32_t dg = g - palette[i].g;
+    const int32_t db = b - palette[i].b;
+    const uint32_t distance = dr * dr + dg * dg + db * db;
+    if (distance < best_distance)
+    {
+      best = i;
+      best_distance = distance;
+    }
+  }
+  return best;
+}
+
+static ALWAYS_INLINE void put_packed_nibble(uint8_t *row, uint16_t x, uint8_t value)
+{
+  uint8_t *pixel = row + (x >> 1);
+  *pixel = (x & 1) ? ((*pixel & 0xf0) | value) : ((*pixel & 0x0f) | value << 4);
+}
+
+static ALWAYS_INLINE int16_t clamp_channel(int32_t value)
+{
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// Floyd-Steinberg error diffusion, one row at a time.
+//
+// Only the errors of the current and the next row are kept. errors needs to
+// hold ERROR_DIFFUSION_SIZE(width, channels) entries, with one channel for
+// gray and three for palette quantization.
+#define ERROR_DIFFUSION_SIZE(width, channels) (2 * ((width) + 2) * (channels))
+
+class ErrorDiffusion
+{
+public:
+  ErrorDiffusion(uint16_t width, uint8_t channels, int16_t *errors)
+      : width(width), channels(channels), current(errors), next(errors + (width + 2) * channels)
+  {
+    memset(errors, 0, ERROR_DIFFUSION_SIZE(width, channels) * sizeof(int16_t));
+  }
+
+  // Quantizes a row of 8 bit gray values into packed photo values.
+  void gray_row(const uint8_t *gray, uint8_t *packed)
+  {
+    for (uint16_t x = 0; x < width; x++)
+    {
+      const int16_t value = clamp_channel(gray[x] + ((current[x + 1] + 8) >> 4));
+      const uint8_t level = quantize_gray(value);
+      diffuse(x, 0, value - gray_of_level(level));
+      put_packed_nibble(packed, x, level);
+    }
+    advance();
+  }
+
+  // Quantizes a row of 8 bit RGB triplets into packed palette indices.
+  void palette_row(const uint8_t *rgb, const palette_color_t *palette, uint8_t count, uint8_t *packed)
+  {
+    for (uint16_t x = 0; x < width; x++)
+    {
+      int16_t value[3];
+      for (uint8_t c = 0; c < 3; c++)
+      {
+        value[c] = clamp_channel(rgb[x * 3 + c] + ((current[(x + 1) * 3 + c] + 8) >> 4));
+      }
+      const uint8_t index = nearest_palette_index(value[0], value[1], value[2], palette, count);
+      diffuse(x, 0, value[0] - palette[index].r);
+      diffuse(x, 1, value[1] - palette[index].g);
+      diffuse(x, 2, value[2] - palette[index].b);
+      put_packed_nibble(packed, x, index);
+    }
+    advance();
+  }
+
+private:
+  // Spreads the error of pixel x with weights of 7/16 to the right and 3/16,
+  // 5/16 and 1/16 to the row below.
+  ALWAYS_INLINE void diffuse(uint16_t x, uint8_t channel, int16_t error)
+  {
+    current[(x + 2) * channels + channel] += error * 7;
+    next[x * channels + channel] += error * 3;
+    next[(x + 1) * channels + channel] += error * 5;
+    next[(x + 2) * channels + channel] += error;
+  }
+
+  void advance()
+  {
+    int16_t *done = current;
+    current = next;
+    next = done;
+    memset(next, 0, (width + 2) * channels * sizeof(int16_t));
+  }
+
+  const uint16_t width;
+  const uint8_t channels;
+  int16_t *current;
+  int16_t *next;
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "util.h"
+
+// Streaming resampler for photos, which do not match the panel resolution.
+//
+// Photos are raw 4 bit per pixel images without any header, so their
+// resolution is derived from the file size. Source rows are pushed one by one
+// in file order and output pixels are handed to a sink as soon as all source
+// rows contributing to them have been seen. Only a single line of
+// accumulators in the width of the panel is needed.
+
+typedef enum photo_fit
+{
+  // Scale to cover the whole panel, cutting off the overlapping edges.
+  FIT_CROP,
+  // Scale to fit into the panel, leaving the background visible at the edges.
+  FIT_LETTERBOX,
+} photo_fit_t;
+
+typedef struct photo_geometry
+{
+  uint16_t width;
+  uint16_t height;
+} photo_geometry_t;
+
+const photo_geometry_t known_photo_geometries[] = {
+    {600, 448},  // Inkplate 6COLOR, Waveshare 5.65" ACEP
+    {800, 600},  // Inkplate 6
+    {1024, 758}, // Inkplate 6PLUS
+    {1200, 825}, // Inkplate 10
+};
+
+inline bool photo_geometry_for_size(uint32_t size, photo_geometry_t *geometry)
+{
+  for (const photo_geometry_t &known : known_photo_geometries)
+  {
+    if ((uint32_t)known.width * known.height / 2 == size)
+    {
+      *geometry = known;
+      return true;
+    }
+  }
+  return false;
+}
+
+typedef struct resample_plan
+{
+  uint16_t src_width;
+  uint16_t src_height;
+  // First source pixel used in both directions.
+  uint16_t crop_x;
+  uint16_t crop_y;
+  // Area on the panel covered by the scaled photo.
+  uint16_t dst_x;
+  uint16_t dst_y;
+  uint16_t dst_width;
+  uint16_t dst_height;
+  // Source pixels per destination pixel in 16.16 fixed point.
+  uint32_t step_x;
+  uint32_t step_y;
+} resample_plan_t;
+
+inline void plan_resample(photo_geometry_t src, photo_geometry_t panel, photo_fit_t fit, resample_plan_t *plan)
+{
+  // Compare aspect ratios without division: src is wider than the panel, if
+  // src.width / src.height > panel.width / panel.height.
+  const bool src_wider = (uint32_t)src.width * panel.height > (uint32_t)panel.width * src.height;
+  uint16_t visible_width = src.width;
+  uint16_t visible_height = src.height;
+
+  plan->src_width = src.width;
+  plan->src_height = src.height;
+  plan->crop_x = 0;
+  plan->crop_y = 0;
+  plan->dst_x = 0;
+  plan->dst_y = 0;
+  plan->dst_width = panel.width;
+  plan->dst_height = panel.height;
+
+  if (fit == FIT_CROP)
+  {
+    if (src_wider)
+    {
+      visible_width = (uint32_t)panel.width * src.height / panel.height;
+      plan->crop_x = (src.width - visible_width) / 2;
+    }
+    else
+    {
+      visible_height = (uint32_t)panel.height * src.width / panel.width;
+      plan->crop_y = (src.height - visible_height) / 2;
+    }
+  }
+  else
+  {
+    if (src_wider)
+    {
+      plan->dst_height = (uint32_t)src.height * panel.width / src.width;
+      plan->dst_y = (panel.height - plan->dst_height) / 2;
+    }
+    else
+    {
+      plan->dst_width = (uint32_t)src.width * panel.height / src.height;
+      plan->dst_x = (panel.width - plan->dst_width) / 2;
+    }
+  }
+
+  // Extreme aspect ratios still cover at least a single pixel.
+  if (visible_width == 0)
+  {
+    visible_width = 1;
+    plan->crop_x = (src.width - 1) / 2;
+  }
+  if (visible_height == 0)
+  {
+    visible_height = 1;
+    plan->crop_y = (src.height - 1) / 2;
+  }
+  if (plan->dst_width == 0)
+  {
+    plan->dst_width = 1;
+    plan->dst_x = (panel.width - 1) / 2;
+  }
+  if (plan->dst_height == 0)
+  {
+    plan->dst_height = 1;
+    plan->dst_y = (panel.height - 1) / 2;
+  }
+
+  plan->step_x = ((uint32_t)visible_width << 16) / plan->dst_width;
+  plan->step_y = ((uint32_t)visible_height << 16) / plan->dst_height;
+}
+
+// Source pixels covered by output pixel i along an axis with the given step:
+// from resample_span_begin() up to resample_span_end(), at least one.
+static ALWAYS_INLINE uint16_t resample_span_begin(uint16_t i, uint32_t step)
+{
+  return ((uint32_t)i * step) >> 16;
+}
+
+static ALWAYS_INLINE uint16_t resample_span_end(uint16_t i, uint32_t step)
+{
+  const uint16_t begin = resample_span_begin(i, step);
+  const uint16_t end = ((uint32_t)(i + 1) * step) >> 16;
+  return end > begin ? end : begin + 1;
+}
+
+// Source pixel closest to the center of output pixel i.
+static ALWAYS_INLINE uint16_t resample_nearest(uint16_t i, uint32_t step)
+{
+  return ((uint32_t)i * step + step / 2) >> 16;
+}
+
+// Rounded average of count source values adding up to sum.
+static ALWAYS_INLINE uint32_t resample_average(uint32_t sum, uint32_t count)
+{
+  return (sum + count / 2) / count;
+}
+
+static ALWAYS_INLINE uint8_t packed_nibble(const uint8_t *row, uint16_t x)
+{
+  return (x & 1) ? (row[x >> 1] & 0x0f) : (row[x >> 1] >> 4);
+}
+
+// Resamples rows of packed 4 bit pixels according to a plan.
+//
+// In box mode every output pixel is the rounded average of all source pixels
+// it covers, which is suitable for gray levels. Otherwise the nearest source
+// pixel is picked, which is required for palette indices, as those can not
+// be averaged.
+//
+// acc needs to hold plan.dst_width entries. The sink is called as
+// sink(x, y, value) with panel coordinates.
+template <typename Sink>
+class PhotoResampler
+{
+public:
+  PhotoResampler(const resample_plan_t &plan, bool box, uint16_t *acc, Sink sink)
+      : plan(plan), box(box), acc(acc), sink(sink), src_row(0), dst_row(0), acc_rows(0)
+  {
+    for (uint16_t x = 0; x < plan.dst_width; x++)
+    {
+      acc[x] = 0;
+    }
+  }
+
+  void push_row(const uint8_t *row)
+  {
+    const uint16_t y = src_row++;
+    if (y < plan.crop_y)
+    {
+      return;
+    }
+    const uint16_t rel_y = y - plan.crop_y;
+
+    while (dst_row < plan.dst_height)
+    {
+      if (box)
+      {
+        const uint16_t first = resample_span_begin(dst_row, plan.step_y);
+        const uint16_t end = resample_span_end(dst_row, plan.step_y);
+        if (rel_y < first)
+        {
+          return;
+        }
+        accumulate(row);
+        if (rel_y + 1 < end)
+        {
+          return;
+        }
+        emit_average();
+      }
+      else
+      {
+        if (rel_y < resample_nearest(dst_row, plan.step_y))
+        {
+          return;
+        }
+        emit_nearest(row);
+      }
+      ++dst_row;
+    }
+  }
+
+  bool done() const
+  {
+    return dst_row >= plan.dst_height;
+  }
+
+  // Panel row of the first output row not handed to the sink yet.
+  uint16_t next_row() const
+  {
+    return plan.dst_y + dst_row;
+  }
+
+private:
+  void accumulate(const uint8_t *row)
+  {
+    for (uint16_t x = 0; x < plan.dst_width; x++)
+    {
+      const uint16_t end = plan.crop_x + resample_span_end(x, plan.step_x);
+      uint16_t sum = 0;
+      for (uint16_t sx = plan.crop_x + resample_span_begin(x, plan.step_x); sx < end; sx++)
+      {
+        sum += packed_nibble(row, sx);
+      }
+      acc[x] += sum;
+    }
+    ++acc_rows;
+  }
+
+  void emit_average()
+  {
+    for (uint16_t x = 0; x < plan.dst_width; x++)
+    {
+      const uint16_t count = acc_rows * (resample_span_end(x, plan.step_x) - resample_span_begin(x, plan.step_x));
+      sink(plan.dst_x + x, plan.dst_y + dst_row, resample_average(acc[x], count));
+      acc[x] = 0;
+    }
+    acc_rows = 0;
+  }
+
+  void emit_nearest(const uint8_t *row)
+  {
+    for (uint16_t x = 0; x < plan.dst_width; x++)
+    {
+      sink(plan.dst_x + x, plan.dst_y + dst_row, packed_nibble(row, plan.crop_x + resample_nearest(x, plan.step_x)));
+    }
+  }
+
+  const resample_plan_t plan;
+  const bool box;
+  uint16_t *acc;
+  Sink sink;
+  uint16_t src_row;
+  uint16_t dst_row;
+  uint16_t acc_rows;
+};
+
+template <typename Sink>
+PhotoResampler<Sink> make_resampler(const resample_plan_t &plan, bool box, uint16_t *acc, Sink sink)
+{
+  return PhotoResampler<Sink>(plan, box, acc, sink);
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "overlay.h"
+#include "panel_backend.h"
+#include "util.h"
+
+// Rendering of the framebuffer in horizontal strips.
+//
+// Framebuffers live in PSRAM, where scattered read-modify-write accesses to
+// single nibbles are slow. Instead each strip of RENDER_STRIP_ROWS rows is
+// assembled in a buffer in internal RAM: photo pixels, tone mapping and the
+// overlay. Finished strips are committed to the framebuffer with a single
+// sequential copy.
+
+#define RENDER_STRIP_ROWS 16
+
+template <typename Panel>
+class StripRenderer
+{
+public:
+  typedef PanelLayout<Panel> Layout;
+
+  // strip needs to hold RENDER_STRIP_ROWS rows. If preload is set, strips
+  // start out with the content of the framebuffer, for renderers which do
+  // not cover every pixel.
+  StripRenderer(uint8_t *framebuffer, uint8_t *strip, const overlay_t *overlay, bool preload)
+      : framebuffer(framebuffer), strip(strip), overlay(overlay), preload(preload), first(0), end(0)
+  {
+  }
+
+  // Returns row y of the current strip. Rows need to be requested in
+  // increasing order. Moving past the current strip commits it, together
+  // with all strips skipped on the way.
+  uint8_t *row(uint16_t y)
+  {
+    while (y >= end)
+    {
+      advance();
+    }
+    return strip + (y - first) * Layout::stride;
+  }
+
+  // Fills row y and all rows below it with value, both pixels of a byte, and
+  // commits all strips, e.g. when a photo ends early.
+  void fill_from(uint16_t y, uint8_t value)
+  {
+    if (y < Panel::height)
+    {
+      uint8_t *data = row(y);
+      memset(data, value, (end - y) * Layout::stride);
+    }
+    while (end < Panel::height)
+    {
+      advance();
+      memset(strip, value, (end - first) * Layout::stride);
+    }
+    commit();
+  }
+
+  // Commits the current strip and all strips not rendered yet.
+  void finish()
+  {
+    while (end < Panel::height)
+    {
+      advance();
+    }
+    commit();
+  }
+
+private:
+  void advance()
+  {
+    commit();
+    first = end;
+    end = first + RENDER_STRIP_ROWS < Panel::height ? first + RENDER_STRIP_ROWS : Panel::height;
+    if (preload)
+    {
+      memcpy(strip, framebuffer + first * Layout::stride, (end - first) * Layout::stride);
+    }
+  }
+
+  void commit()
+  {
+    if (end == first)
+    {
+      return;
+    }
+    overlay_blit(overlay, strip, Layout::stride, Panel::width, first, end);
+    memcpy(framebuffer + first * Layout::stride, strip, (end - first) * Layout::stride);
+    first = end;
+  }
+
+  uint8_t *framebuffer;
+  uint8_t *strip;
+  const overlay_t *overlay;
+  const bool preload;
+  uint16_t first;
+  uint16_t end;
+};
+
+// Reads photo data of the panel's own resolution strip by strip and maps it
+// in place through a table of byte pairs (see tone_map.h). Without a table
+// the data is used as read. idle() is called after every strip, e.g. to
+// advance the power up of the panel.
+//
+// Returns false, if the file ended early or could not be read. The rest of
+// the panel is white then.
+template <typename Panel, typename File, typename Idle>
+bool ingest_photo(File *file, StripRenderer<Panel> *renderer, const uint8_t *pair_lut, Idle idle)
+{
+  typedef PanelLayout<Panel> Layout;
+  const uint8_t white = Panel::white << 4 | Panel::white;
+
+  for (uint16_t y = 0; y < Panel::height; y += RENDER_STRIP_ROWS)
+  {
+    const uint16_t rows = Panel::height - y < RENDER_STRIP_ROWS ? Panel::height - y : RENDER_STRIP_ROWS;
+    const uint32_t len = rows * Layout::stride;
+    uint8_t *data = renderer->row(y);
+    const int n_bytes = file->read(data, len);
+    if (pair_lut != nullptr)
+    {
+      for (int i = 0; i < n_bytes; i++)
+      {
+        data[i] = pair_lut[data[i]];
+      }
+    }
+    if (n_bytes < (int)len)
+    {
+      const uint32_t valid = n_bytes > 0 ? n_bytes : 0;
+      memset(data + valid, white, len - valid);
+      renderer->fill_from(y + rows, white);
+      return false;
+    }
+    idle();
+  }
+  renderer->finish();
+  return true;
+}
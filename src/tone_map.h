@@ -0,0 +1,152 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "panel_backend.h"
+#include "quantize.h"
+#include "util.h"
+
+// Tone mapping of photo values to panel values.
+//
+// A tone curve is compiled into lookup tables once per wake. The 256 entry
+// pair table maps a byte of two photo pixels directly to a byte of two panel
+// pixels, replacing the fixed conversion of the panel backend, so applying
+// the curve does not cost anything extra per pixel.
+//
+// Curves can be calibrated with a text file on the SD card:
+//
+//   # Comments start with a hash.
+//   gamma=1.2
+//   black=1
+//   white=14
+//   palette=0,1,2,3,4,5,6
+//
+// gamma, black and white apply to gray panels: photo values up to black
+// become the darkest, values from white on the brightest panel level, with
+// the gamma curve in between. palette remaps the indices of color panels.
+
+#define TONE_FILE_MAX_SIZE 512
+
+typedef struct tone_curve
+{
+  float gamma;
+  uint8_t black;
+  uint8_t white;
+  uint8_t palette[16];
+} tone_curve_t;
+
+typedef struct tone_map
+{
+  // Photo value to panel value.
+  uint8_t nibble[16];
+  // Byte of two photo pixels to byte of two panel pixels.
+  uint8_t pair[256];
+  // The pair table does not change anything.
+  bool identity;
+} tone_map_t;
+
+inline void default_tone_curve(tone_curve_t *curve)
+{
+  curve->gamma = 1.0f;
+  curve->black = 0;
+  curve->white = 15;
+  for (uint8_t i = 0; i < 16; i++)
+  {
+    curve->palette[i] = i;
+  }
+}
+
+// Parses key=value lines into curve. Keys not given keep their value.
+// Returns false on unknown keys or invalid values.
+inline bool parse_tone_curve(const char *text, tone_curve_t *curve)
+{
+  char line[80];
+
+  while (*text != '\0')
+  {
+    const char *end = strchr(text, '\n');
+    const size_t len = end != nullptr ? end - text : strlen(text);
+    const size_t copied = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+    memcpy(line, text, copied);
+    line[copied] = '\0';
+    text += end != nullptr ? len + 1 : len;
+
+    char *value = strchr(line, '=');
+    if (line[0] == '#' || line[0] == '\r' || line[0] == '\0')
+    {
+      continue;
+    }
+    if (value == nullptr)
+    {
+      return false;
+    }
+    *value++ = '\0';
+
+    if (strcmp(line, "gamma") == 0)
+    {
+      curve->gamma = strtof(value, nullptr);
+      if (!(curve->gamma > 0.0f))
+      {
+        return false;
+      }
+    }
+    else if (strcmp(line, "black") == 0)
+    {
+      curve->black = strtoul(value, nullptr, 10) & 0x0f;
+    }
+    else if (strcmp(line, "white") == 0)
+    {
+      curve->white = strtoul(value, nullptr, 10) & 0x0f;
+    }
+    else if (strcmp(line, "palette") == 0)
+    {
+      for (uint8_t i = 0; i < 16 && *value != '\0'; i++)
+      {
+        curve->palette[i] = strtoul(value, &value, 10) & 0x0f;
+        if (*value == ',')
+        {
+          ++value;
+        }
+      }
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return curve->white > curve->black;
+}
+
+template <typename Panel>
+void build_tone_map(const tone_curve_t &curve, tone_map_t *map)
+{
+  for (uint8_t value = 0; value < 16; value++)
+  {
+    if (Panel::palette)
+    {
+      map->nibble[value] = Panel::convert(curve.palette[value]);
+      continue;
+    }
+
+    float level = 0.0f;
+    if (value >= curve.white)
+    {
+      level = 1.0f;
+    }
+    else if (value > curve.black)
+    {
+      level = powf((float)(value - curve.black) / (curve.white - curve.black), curve.gamma);
+    }
+    map->nibble[value] = Panel::convert(quantize_level(level));
+  }
+
+  map->identity = true;
+  for (uint16_t value = 0; value < 256; value++)
+  {
+    map->pair[value] = map->nibble[value >> 4] << 4 | map->nibble[value & 0x0f];
+    map->identity = map->identity && map->pair[value] == value;
+  }
+}
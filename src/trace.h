@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Tracing with compile time level filtering.
+//
+// Trace statements above TRACE_LEVEL expand to nothing, including their
+// arguments. Release builds set TRACE_LEVEL to TRACE_LEVEL_NONE, which removes
+// all of them, together with the serial port setup.
+//
+// TRACE_POINT emits a structured trace point: a dotted name followed by
+// key=value pairs. TRACE_SPAN_BEGIN/TRACE_SPAN_END measure the time between
+// them and emit it as a trace point.
+
+#define TRACE_LEVEL_NONE 0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_DEBUG 3
+#define TRACE_LEVEL_VERBOSE 4
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_DEBUG
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_E(format, ...) log_e(format, ##__VA_ARGS__)
+#else
+#define TRACE_E(format, ...) do {} while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_I(format, ...) log_i(format, ##__VA_ARGS__)
+#else
+#define TRACE_I(format, ...) do {} while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_D(format, ...) log_d(format, ##__VA_ARGS__)
+#define TRACE_POINT(name, format, ...) log_d("@" name " " format, ##__VA_ARGS__)
+#define TRACE_SPAN_BEGIN(name) const uint32_t trace_span_##name = micros()
+#define TRACE_SPAN_END(name) TRACE_POINT(#name, "us=%lu", (unsigned long)(micros() - trace_span_##name))
+#else
+#define TRACE_D(format, ...) do {} while (0)
+#define TRACE_POINT(name, format, ...) do {} while (0)
+#define TRACE_SPAN_BEGIN(name) do {} while (0)
+#define TRACE_SPAN_END(name) do {} while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_VERBOSE
+#define TRACE_V(format, ...) log_v(format, ##__VA_ARGS__)
+#else
+#define TRACE_V(format, ...) do {} while (0)
+#endif
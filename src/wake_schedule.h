@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Wakes aligned to the clock.
+//
+// Wakes are scheduled for multiples of the wake interval, e.g. every full
+// quarter hour, instead of a fixed time after the previous wake, so the time
+// spent awake does not accumulate from wake to wake. The schedule is meant to
+// be kept in RTC memory across deep sleep.
+//
+// Every wake by the sleep timer measures how late it started against its
+// target. This covers boot time as well as the error of the RTC timer over
+// the sleep. Half of it is added to a correction, which all following sleeps
+// are shortened by, so wakes settle on their targets.
+//
+// Times are microseconds on the RTC clock as returned by gettimeofday(). Once
+// the clock has been set, boundaries are those of the wall clock and quiet
+// hours can be skipped. Before that, boundaries count from power up.
+
+#define WAKE_SCHEDULE_MAGIC 0x5743484B
+// Times before 2020 mean the clock has never been set.
+#define WAKE_SCHEDULE_VALID_EPOCH 1577836800ULL
+// Largest correction applied, bigger deviations are not caused by the timer.
+#define WAKE_MAX_CORRECTION_US (30LL * 1000 * 1000)
+#define WAKE_MIN_SLEEP_US (1000ULL * 1000)
+
+typedef struct wake_schedule
+{
+  uint32_t magic;
+  // Learned lateness of wakes, subtracted from every sleep.
+  int32_t correction_us;
+  // Time the pending wake is scheduled for, 0 if there is none.
+  uint64_t target_us;
+  // Duration of the last sleep.
+  uint64_t sleep_us;
+  // Time the current wake started.
+  uint64_t arrived_us;
+} wake_schedule_t;
+
+static inline bool wake_schedule_wall_clock(uint64_t now_us)
+{
+  return now_us / 1000000 >= WAKE_SCHEDULE_VALID_EPOCH;
+}
+
+// Records the start of a wake. timer tells whether the wake was caused by
+// the sleep timer. Returns true and the lateness against the target, if it
+// could be measured.
+inline bool wake_schedule_arrive(wake_schedule_t *schedule, uint64_t now_us, bool timer, int64_t *late_us)
+{
+  if (schedule->magic != WAKE_SCHEDULE_MAGIC)
+  {
+    memset(schedule, 0, sizeof(*schedule));
+    schedule->magic = WAKE_SCHEDULE_MAGIC;
+  }
+  schedule->arrived_us = now_us;
+  if (!timer || schedule->target_us == 0)
+  {
+    return false;
+  }
+
+  *late_us = (int64_t)(now_us - schedule->target_us);
+  // The clock has been set in between.
+  if (*late_us > WAKE_MAX_CORRECTION_US || *late_us < -WAKE_MAX_CORRECTION_US)
+  {
+    return false;
+  }
+  int64_t correction = schedule->correction_us + *late_us / 2;
+  correction = correction > WAKE_MAX_CORRECTION_US ? WAKE_MAX_CORRECTION_US : correction;
+  correction = correction < -WAKE_MAX_CORRECTION_US ? -WAKE_MAX_CORRECTION_US : correction;
+  schedule->correction_us = correction;
+  return true;
+}
+
+// Moves the current wake by offset_us, when the clock has been set during
+// it. The pending target belongs to the old time line and is dropped.
+inline void wake_schedule_shift(wake_schedule_t *schedule, int64_t offset_us)
+{
+  schedule->arrived_us += offset_us;
+  schedule->target_us = 0;
+}
+
+// Deviation of the last sleep in parts per million.
+inline int32_t wake_schedule_drift_ppm(const wake_schedule_t *schedule, int64_t late_us)
+{
+  return schedule->sleep_us != 0 ? late_us * 1000000 / (int64_t)schedule->sleep_us : 0;
+}
+
+// Local hours from start up to end, wrapping at midnight. Equal hours
+// disable quiet hours.
+inline bool wake_in_quiet_hours(uint64_t time_us, uint8_t start, uint8_t end)
+{
+  const time_t seconds = time_us / 1000000;
+  struct tm local;
+
+  if (start == end)
+  {
+    return false;
+  }
+  localtime_r(&seconds, &local);
+  return start < end ? local.tm_hour >= start && local.tm_hour < end : local.tm_hour >= start || local.tm_hour < end;
+}
+
+static inline uint64_t wake_align_up(uint64_t time_us, uint64_t interval_us)
+{
+  return (time_us + interval_us - 1) / interval_us * interval_us;
+}
+
+// Schedules the next wake at the first boundary leaving at least a quarter
+// of the interval to sleep, so a long wake does not cause another one right
+// after it. Boundaries within quiet hours are skipped, if the clock is set.
+// Returns the time to sleep.
+inline uint64_t wake_schedule_next(wake_schedule_t *schedule, uint64_t now_us, uint64_t interval_us, uint8_t quiet_start,
+                                   uint8_t quiet_end)
+{
+  const int64_t correction = schedule->correction_us;
+  uint64_t target = wake_align_up(now_us + 1, interval_us);
+
+  while ((int64_t)(target - now_us) - correction < (int64_t)(interval_us / 4))
+  {
+    target += interval_us;
+  }
+  if (wake_schedule_wall_clock(now_us) && wake_in_quiet_hours(target, quiet_start, quiet_end))
+  {
+    const time_t seconds = target / 1000000;
+    struct tm local;
+
+    localtime_r(&seconds, &local);
+    if (local.tm_hour >= quiet_end)
+    {
+      ++local.tm_mday;
+    }
+    local.tm_hour = quiet_end;
+    local.tm_min = 0;
+    local.tm_sec = 0;
+    local.tm_isdst = -1;
+    target = wake_align_up((uint64_t)mktime(&local) * 1000000, interval_us);
+  }
+
+  const int64_t sleep = (int64_t)(target - now_us) - correction;
+  schedule->target_us = target;
+  schedule->sleep_us = sleep > (int64_t)WAKE_MIN_SLEEP_US ? sleep : WAKE_MIN_SLEEP_US;
+  return schedule->sleep_us;
+}
@@ -0,0 +1,326 @@
+// Host replay of SD card I/O traces.
+//
+// Reads a trace recorded by the firmware built with -DENABLE_IO_TRACE (see
+// src/io_trace.h) and replays it against an image of the card: every sector
+// touched by a read or write is read from the image, so traces can be checked
+// against the layout of the card they were recorded on. Writes are not
+// applied to the image.
+//
+// Alongside, a latency model estimates the time every operation takes on a
+// card with the given timings. It mirrors the single sector cache of SdFat:
+// partial sector accesses hitting the cached sector are free. Sequential
+// sectors do not pay the access time. Comparing the modeled time with the
+// recorded one per phase tells whether a change in the I/O pattern or the
+// card is responsible for slow wakes.
+//
+// Build and run from the repository root:
+//   g++ -O2 -std=c++17 -Isrc tools/io_replay.cpp -o io_replay
+//   ./io_replay [--read-us 250] [--write-us 400] [--access-us 150] [--sync-us 2000]
+//               [--open-us 1000] [--rename-us 3000] [--wake N] iotrace.bin card.img
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "io_trace.h"
+
+typedef struct latency_model
+{
+  uint32_t read_us;
+  uint32_t write_us;
+  uint32_t access_us;
+  uint32_t sync_us;
+  uint32_t open_us;
+  uint32_t rename_us;
+} latency_model_t;
+
+typedef struct phase_stats
+{
+  uint32_t ops[IO_OP_COUNT];
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t sectors;
+  uint64_t recorded_us;
+  uint64_t modeled_us;
+} phase_stats_t;
+
+const char *phase_names[IO_PHASE_COUNT] = {
+    "other", "init_config", "build_index", "scan_index", "display_photo", "update_config",
+};
+
+const char *op_names[IO_OP_COUNT] = {
+    "open", "close", "read", "write", "seek", "sync", "truncate", "rename", "remove", "wake",
+};
+
+class CardModel
+{
+public:
+  CardModel(const latency_model_t &model, FILE *image, uint64_t image_sectors)
+      : model(model), image(image), image_sectors(image_sectors)
+  {
+  }
+
+  // Returns the modeled time of a record and reads its sectors from the
+  // image.
+  uint64_t replay(const io_trace_record_t &record, uint64_t *sectors)
+  {
+    switch (record.op)
+    {
+    case IO_OP_READ:
+    case IO_OP_WRITE:
+      return transfer(record, sectors);
+    case IO_OP_OPEN:
+      return model.open_us;
+    case IO_OP_SYNC:
+    case IO_OP_TRUNCATE:
+      return model.sync_us;
+    case IO_OP_CLOSE:
+      // Closing syncs pending writes, which is modeled by the write itself.
+      return 0;
+    case IO_OP_RENAME:
+    case IO_OP_REMOVE:
+      return model.rename_us;
+    default:
+      return 0;
+    }
+  }
+
+  uint64_t out_of_range() const
+  {
+    return invalid;
+  }
+
+private:
+  uint64_t transfer(const io_trace_record_t &record, uint64_t *sectors)
+  {
+    if (record.length == 0)
+    {
+      return 0;
+    }
+    const bool write = record.op == IO_OP_WRITE;
+    const uint32_t first = record.offset % IO_TRACE_SECTOR_SIZE;
+    const uint32_t count = (first + record.length + IO_TRACE_SECTOR_SIZE - 1) / IO_TRACE_SECTOR_SIZE;
+    uint64_t us = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      const uint64_t sector = (uint64_t)record.sector + i;
+      const uint32_t begin = i == 0 ? first : 0;
+      const uint32_t end = i + 1 == count ? (first + record.length - 1) % IO_TRACE_SECTOR_SIZE + 1 : IO_TRACE_SECTOR_SIZE;
+      const bool partial = begin != 0 || end != IO_TRACE_SECTOR_SIZE;
+
+      if (partial && sector == cached)
+      {
+        continue;
+      }
+      // A partial write needs the rest of the sector first.
+      if (!write || partial)
+      {
+        us += access(sector) + model.read_us;
+      }
+      if (write)
+      {
+        us += access(sector) + model.write_us;
+      }
+      if (partial)
+      {
+        cached = sector;
+      }
+      touch(sector);
+      ++*sectors;
+    }
+    return us;
+  }
+
+  uint32_t access(uint64_t sector)
+  {
+    const bool sequential = sector == last + 1 || sector == last;
+    last = sector;
+    return sequential ? 0 : model.access_us;
+  }
+
+  void touch(uint64_t sector)
+  {
+    uint8_t buffer[IO_TRACE_SECTOR_SIZE];
+    if (sector == 0 || sector >= image_sectors || fseek(image, sector * IO_TRACE_SECTOR_SIZE, SEEK_SET) != 0 ||
+        fread(buffer, 1, sizeof(buffer), image) != sizeof(buffer))
+    {
+      ++invalid;
+    }
+  }
+
+  const latency_model_t model;
+  FILE *image;
+  const uint64_t image_sectors;
+  uint64_t cached = UINT64_MAX;
+  uint64_t last = UINT64_MAX - 1;
+  uint64_t invalid = 0;
+};
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [--read-us N] [--write-us N] [--access-us N] [--sync-us N] [--open-us N] [--rename-us N]"
+          " [--wake N] <trace> <card image>\n",
+          program);
+}
+
+int main(int argc, char **argv)
+{
+  latency_model_t model = {250, 400, 150, 2000, 1000, 3000};
+  struct
+  {
+    const char *name;
+    uint32_t *value;
+  } options[] = {
+      {"--read-us", &model.read_us}, {"--write-us", &model.write_us}, {"--access-us", &model.access_us},
+      {"--sync-us", &model.sync_us}, {"--open-us", &model.open_us},   {"--rename-us", &model.rename_us},
+  };
+  long only_wake = -1;
+  std::vector<const char *> paths;
+
+  for (int i = 1; i < argc; i++)
+  {
+    bool matched = false;
+    for (auto &option : options)
+    {
+      if (strcmp(argv[i], option.name) == 0 && i + 1 < argc)
+      {
+        *option.value = strtoul(argv[++i], nullptr, 10);
+        matched = true;
+      }
+    }
+    if (matched)
+    {
+      continue;
+    }
+    if (strcmp(argv[i], "--wake") == 0 && i + 1 < argc)
+    {
+      only_wake = strtol(argv[++i], nullptr, 10);
+    }
+    else if (argv[i][0] != '-')
+    {
+      paths.push_back(argv[i]);
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (paths.size() != 2)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *trace = fopen(paths[0], "rb");
+  FILE *image = fopen(paths[1], "rb");
+  if (trace == nullptr || image == nullptr)
+  {
+    fprintf(stderr, "Could not open '%s'\n", trace == nullptr ? paths[0] : paths[1]);
+    return 1;
+  }
+  io_trace_header_t header;
+  if (fread(&header, sizeof(header), 1, trace) != 1 || memcmp(header.magic, io_trace_magic, sizeof(io_trace_magic)) != 0 ||
+      header.record_size != sizeof(io_trace_record_t))
+  {
+    fprintf(stderr, "'%s' is not an I/O trace\n", paths[0]);
+    return 1;
+  }
+  fseek(image, 0, SEEK_END);
+  const uint64_t image_sectors = ftell(image) / IO_TRACE_SECTOR_SIZE;
+
+  std::vector<phase_stats_t> phases(IO_PHASE_COUNT);
+  memset(phases.data(), 0, phases.size() * sizeof(phase_stats_t));
+  uint64_t invalid = 0;
+  uint64_t dropped = 0;
+  long wakes = 0;
+  long replayed = 0;
+  io_trace_record_t wake;
+  while (fread(&wake, sizeof(wake), 1, trace) == 1)
+  {
+    if (wake.op != IO_OP_WAKE)
+    {
+      fprintf(stderr, "Trace is corrupt after %ld wakes\n", wakes);
+      return 1;
+    }
+    std::vector<io_trace_record_t> records(wake.length);
+    if (fread(records.data(), sizeof(io_trace_record_t), records.size(), trace) != records.size())
+    {
+      fprintf(stderr, "Trace of wake %ld is truncated\n", wakes);
+      return 1;
+    }
+    if (wakes++ != only_wake && only_wake >= 0)
+    {
+      continue;
+    }
+    ++replayed;
+
+    // Every wake starts with a fresh SdFat cache.
+    CardModel card(model, image, image_sectors);
+    dropped += wake.sector;
+    for (const io_trace_record_t &record : records)
+    {
+      if (record.op >= IO_OP_WAKE || record.phase >= IO_PHASE_COUNT)
+      {
+        continue;
+      }
+      phase_stats_t &stats = phases[record.phase];
+      ++stats.ops[record.op];
+      stats.recorded_us += record.duration_us;
+      stats.modeled_us += card.replay(record, &stats.sectors);
+      if (record.op == IO_OP_READ)
+      {
+        stats.bytes_read += record.length;
+      }
+      else if (record.op == IO_OP_WRITE)
+      {
+        stats.bytes_written += record.length;
+      }
+    }
+    invalid += card.out_of_range();
+  }
+
+  printf("%ld wakes replayed, %llu records dropped while recording, %llu sectors outside the image\n", replayed,
+         (unsigned long long)dropped, (unsigned long long)invalid);
+  if (replayed == 0)
+  {
+    return 0;
+  }
+  printf("%-14s %8s %8s %8s %8s %10s %10s %8s %12s %12s\n", "phase", "opens", "reads", "writes", "syncs", "KiB read",
+         "KiB write", "sectors", "recorded ms", "modeled ms");
+  phase_stats_t total;
+  memset(&total, 0, sizeof(total));
+  for (uint8_t phase = 0; phase < IO_PHASE_COUNT; phase++)
+  {
+    const phase_stats_t &stats = phases[phase];
+    for (uint8_t op = 0; op < IO_OP_COUNT; op++)
+    {
+      total.ops[op] += stats.ops[op];
+    }
+    total.bytes_read += stats.bytes_read;
+    total.bytes_written += stats.bytes_written;
+    total.sectors += stats.sectors;
+    total.recorded_us += stats.recorded_us;
+    total.modeled_us += stats.modeled_us;
+    printf("%-14s %8u %8u %8u %8u %10.1f %10.1f %8llu %12.1f %12.1f\n", phase_names[phase], stats.ops[IO_OP_OPEN],
+           stats.ops[IO_OP_READ], stats.ops[IO_OP_WRITE], stats.ops[IO_OP_SYNC], stats.bytes_read / 1024.0,
+           stats.bytes_written / 1024.0, (unsigned long long)stats.sectors, stats.recorded_us / 1000.0,
+           stats.modeled_us / 1000.0);
+  }
+  printf("%-14s %8u %8u %8u %8u %10.1f %10.1f %8llu %12.1f %12.1f\n", "total", total.ops[IO_OP_OPEN],
+         total.ops[IO_OP_READ], total.ops[IO_OP_WRITE], total.ops[IO_OP_SYNC], total.bytes_read / 1024.0,
+         total.bytes_written / 1024.0, (unsigned long long)total.sectors, total.recorded_us / 1000.0,
+         total.modeled_us / 1000.0);
+  printf("%-14s %8s %8s %8s %8s %10s %10s %8s %12.1f %12.1f\n", "per wake", "", "", "", "", "", "", "",
+         total.recorded_us / 1000.0 / replayed, total.modeled_us / 1000.0 / replayed);
+  for (uint8_t op = 0; op < IO_OP_WAKE; op++)
+  {
+    printf("%s%s=%u", op == 0 ? "ops: " : " ", op_names[op], total.ops[op]);
+  }
+  printf("\n");
+  return 0;
+}
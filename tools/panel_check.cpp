@@ -0,0 +1,331 @@
+// Host check of the panel backends.
+//
+// Runs every backend of src/panel_backend.h on known pixel patterns and
+// compares the framebuffer with the one the per panel code they replaced
+// produced: drawPixel() of the Inkplate and ACEP drivers fed pixel by pixel,
+// the gray conversion and overlay colors picked by #ifdef and the status bar
+// blitted over the whole framebuffer. Covers photos of the panel's own
+// resolution with the default tone curve, resampled photos in both fits and
+// the status bar, as well as the layout, blank color and tone file of every
+// panel. Photos ending early have to leave the panel white below their last
+// row.
+//
+// Build and run from the repository root:
+//   g++ -O2 -std=c++17 -Isrc tools/panel_check.cpp -o panel_check && ./panel_check
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "overlay_sprites.h"
+#include "panel_backend.h"
+#include "resample.h"
+#include "strip_renderer.h"
+#include "tone_map.h"
+
+// The panels as they were told apart before the backends.
+typedef enum legacy_panel
+{
+  LEGACY_INKPLATE_GRAY,
+  LEGACY_INKPLATE_COLOR,
+  LEGACY_ACEP,
+} legacy_panel_t;
+
+typedef struct legacy_description
+{
+  legacy_panel_t kind;
+  // Resampling with a box filter, instead of picking the nearest pixel.
+  bool box;
+  // OVERLAY_INK and OVERLAY_PAPER
+  uint8_t overlay_ink;
+  uint8_t overlay_paper;
+  // Byte the driver clears its framebuffer with.
+  uint8_t clear;
+  const char *tone_file;
+} legacy_description_t;
+
+// Framebuffer written like the drivers did, E_INK_WIDTH / 2 bytes per row.
+class LegacyFramebuffer
+{
+public:
+  LegacyFramebuffer(const legacy_description_t &panel, uint16_t width, uint16_t height)
+      : panel(panel), width(width), height(height), data(width / 2 * height, panel.clear)
+  {
+  }
+
+  // draw_photo_pixel() of main.cpp.
+  void draw_photo_pixel(uint16_t x, uint16_t y, uint8_t value)
+  {
+    switch (panel.kind)
+    {
+    case LEGACY_INKPLATE_GRAY:
+      inkplate_draw_pixel(x, y, value >> 1);
+      break;
+    case LEGACY_INKPLATE_COLOR:
+      inkplate_draw_pixel(x, y, value);
+      break;
+    case LEGACY_ACEP:
+      acep_draw_pixel(x, y, value);
+      break;
+    }
+  }
+
+  // Reading a photo of the panel's resolution byte by byte.
+  void draw_photo(const std::vector<uint8_t> &photo)
+  {
+    const uint16_t row_bytes = width / 2;
+    for (uint32_t offset = 0; offset < photo.size(); offset++)
+    {
+      const uint16_t y = offset / row_bytes;
+      const uint16_t x = offset % row_bytes * 2;
+      draw_photo_pixel(x, y, photo[offset] >> 4 & 0x0f);
+      draw_photo_pixel(x + 1, y, photo[offset] & 0x0f);
+    }
+  }
+
+  const legacy_description_t panel;
+  const uint16_t width;
+  const uint16_t height;
+  std::vector<uint8_t> data;
+
+private:
+  // Inkplate::drawPixel() in 3 bit mode and on the 6COLOR: the left pixel
+  // goes into the high nibble of DMemory4Bit.
+  void inkplate_draw_pixel(uint16_t x, uint16_t y, uint8_t color)
+  {
+    color &= panel.kind == LEGACY_INKPLATE_GRAY ? 7 : 15;
+    uint8_t *pixel = &data[width / 2 * y + x / 2];
+    *pixel = (*pixel & (x % 2 ? 0xf0 : 0x0f)) | color << (x % 2 ? 0 : 4);
+  }
+
+  // Adafruit_ACEP_PSRAM::drawPixel() without rotation.
+  void acep_draw_pixel(uint16_t x, uint16_t y, uint8_t color)
+  {
+    uint8_t *pixel = &data[((uint32_t)x + (uint32_t)y * width) / 2];
+    if (x % 2)
+    {
+      *pixel = (*pixel & 0xf0) | (color & 0x0f);
+    }
+    else
+    {
+      *pixel = (*pixel & 0x0f) | (color & 0x0f) << 4;
+    }
+  }
+};
+
+class MemoryFile
+{
+public:
+  MemoryFile(const std::vector<uint8_t> &data) : data(data), position(0) {}
+
+  int read(void *buffer, size_t len)
+  {
+    const size_t n_bytes = len < data.size() - position ? len : data.size() - position;
+    memcpy(buffer, &data[position], n_bytes);
+    position += n_bytes;
+    return n_bytes;
+  }
+
+private:
+  const std::vector<uint8_t> &data;
+  size_t position;
+};
+
+static std::vector<uint8_t> make_photo(photo_geometry_t geometry, uint32_t seed)
+{
+  std::vector<uint8_t> photo((uint32_t)geometry.width * geometry.height / 2);
+  uint32_t state = seed;
+  for (uint32_t i = 0; i < photo.size(); i++)
+  {
+    // Gradients on the left half of every row, noise on the right one.
+    const uint32_t x = i % (geometry.width / 2);
+    state = state * 1664525 + 1013904223;
+    photo[i] = x < geometry.width / 4 ? (x * 16 / (geometry.width / 4)) * 0x11 : state >> 24;
+  }
+  return photo;
+}
+
+static void build_status_bar(overlay_t *overlay, uint16_t width, uint16_t height, uint8_t ink, uint8_t paper)
+{
+  overlay_begin_bar(overlay, height - 40, 40, ink, paper);
+  const uint16_t x = overlay_add_sprite(overlay, &sprite_battery, 10, height - 30);
+  overlay_add_text(overlay, "3.71V", x + 6, height - 30);
+  overlay_add_sprite(overlay, &sprite_label_low, width - 60, height - 30);
+}
+
+static bool compare(const char *panel, const char *what, const std::vector<uint8_t> &expected, const uint8_t *actual)
+{
+  for (uint32_t i = 0; i < expected.size(); i++)
+  {
+    if (expected[i] != actual[i])
+    {
+      printf("%-14s %-28s differs at byte %u: %02x instead of %02x\n", panel, what, i, actual[i], expected[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Panel>
+static bool check_panel(const char *name, const legacy_description_t &legacy, uint16_t legacy_width,
+                        uint16_t legacy_height)
+{
+  typedef PanelLayout<Panel> Layout;
+  bool ok = true;
+
+  // Description of the panel.
+  if (Panel::width != legacy_width || Panel::height != legacy_height || Layout::stride != legacy_width / 2u ||
+      Layout::size != legacy_width / 2u * legacy_height)
+  {
+    printf("%-14s layout %ux%u, stride %u, size %u\n", name, Panel::width, Panel::height, Layout::stride, Layout::size);
+    ok = false;
+  }
+  if (Panel::palette == legacy.box || Panel::overlay_ink != legacy.overlay_ink ||
+      Panel::overlay_paper != legacy.overlay_paper)
+  {
+    printf("%-14s palette %d, overlay colors %u/%u\n", name, Panel::palette, Panel::overlay_ink, Panel::overlay_paper);
+    ok = false;
+  }
+  const uint8_t level_mask = legacy.kind == LEGACY_INKPLATE_GRAY ? 7 : 15;
+  if (Panel::white != (legacy.clear & level_mask) || strcmp(Panel::tone_file(), legacy.tone_file) != 0)
+  {
+    printf("%-14s white %u, tone file %s\n", name, Panel::white, Panel::tone_file());
+    ok = false;
+  }
+
+  tone_curve_t curve;
+  tone_map_t tone_map;
+  default_tone_curve(&curve);
+  build_tone_map<Panel>(curve, &tone_map);
+
+  std::vector<uint8_t> framebuffer(Layout::size);
+  std::vector<uint8_t> strip(RENDER_STRIP_ROWS * Layout::stride);
+  overlay_t no_overlay;
+  overlay_t status_bar;
+  overlay_begin_bar(&no_overlay, 0, 0, Panel::overlay_ink, Panel::overlay_paper);
+  build_status_bar(&status_bar, Panel::width, Panel::height, Panel::overlay_ink, Panel::overlay_paper);
+
+  // Photos of the panel's resolution, with and without status bar.
+  const photo_geometry_t native = {Panel::width, Panel::height};
+  const std::vector<uint8_t> photo = make_photo(native, 1);
+  for (int with_bar = 0; with_bar < 2; with_bar++)
+  {
+    LegacyFramebuffer expected(legacy, legacy_width, legacy_height);
+    expected.draw_photo(photo);
+    if (with_bar)
+    {
+      overlay_t legacy_bar;
+      build_status_bar(&legacy_bar, legacy_width, legacy_height, legacy.overlay_ink, legacy.overlay_paper);
+      overlay_blit(&legacy_bar, expected.data.data(), legacy_width / 2, legacy_width, 0, legacy_height);
+    }
+
+    MemoryFile file(photo);
+    memset(framebuffer.data(), Panel::white * 0x11, framebuffer.size());
+    StripRenderer<Panel> renderer(framebuffer.data(), strip.data(), with_bar ? &status_bar : &no_overlay, false);
+    if (!ingest_photo(&file, &renderer, tone_map.identity ? nullptr : tone_map.pair, []() {}))
+    {
+      printf("%-14s photo ended early\n", name);
+      ok = false;
+    }
+    ok = compare(name, with_bar ? "photo with status bar" : "photo", expected.data, framebuffer.data()) && ok;
+  }
+
+  // A photo ending early in the middle of a row leaves the panel white from
+  // there on.
+  {
+    const std::vector<uint8_t> truncated(photo.begin(), photo.begin() + photo.size() / 3 + 7);
+    LegacyFramebuffer expected(legacy, legacy_width, legacy_height);
+    expected.draw_photo(truncated);
+    memset(&expected.data[truncated.size()], Panel::white * 0x11, expected.data.size() - truncated.size());
+
+    MemoryFile file(truncated);
+    memset(framebuffer.data(), legacy.clear, framebuffer.size());
+    StripRenderer<Panel> renderer(framebuffer.data(), strip.data(), &no_overlay, false);
+    if (ingest_photo(&file, &renderer, tone_map.identity ? nullptr : tone_map.pair, []() {}))
+    {
+      printf("%-14s short photo not reported\n", name);
+      ok = false;
+    }
+    ok = compare(name, "photo short", expected.data, framebuffer.data()) && ok;
+  }
+
+  // Photos of the other known resolutions, resampled.
+  for (const photo_geometry_t &geometry : known_photo_geometries)
+  {
+    if (geometry.width == Panel::width && geometry.height == Panel::height)
+    {
+      continue;
+    }
+    const std::vector<uint8_t> source = make_photo(geometry, geometry.width);
+    const uint16_t row_bytes = geometry.width / 2;
+    for (photo_fit_t fit : {FIT_CROP, FIT_LETTERBOX})
+    {
+      // The whole photo, and one ending early, which leaves the panel white
+      // below the last complete row.
+      for (uint16_t rows : {geometry.height, (uint16_t)(geometry.height / 4)})
+      {
+        resample_plan_t plan;
+        std::vector<uint16_t> acc(Panel::width);
+        plan_resample(geometry, native, fit, &plan);
+
+        LegacyFramebuffer expected(legacy, legacy_width, legacy_height);
+        auto legacy_resampler = make_resampler(plan, legacy.box, acc.data(), [&expected](uint16_t x, uint16_t y, uint8_t value) {
+          expected.draw_photo_pixel(x, y, value);
+        });
+        for (uint16_t y = 0; y < rows && !legacy_resampler.done(); y++)
+        {
+          legacy_resampler.push_row(&source[y * row_bytes]);
+        }
+        if (rows < geometry.height)
+        {
+          const uint32_t offset = legacy_resampler.next_row() * (legacy_width / 2u);
+          memset(&expected.data[offset], Panel::white * 0x11, expected.data.size() - offset);
+        }
+
+        // As read_and_resample_photo() in main.cpp. The strip still holds
+        // the previous photo.
+        memset(framebuffer.data(), legacy.clear, framebuffer.size());
+        const bool covers_panel = plan.dst_width == Panel::width && plan.dst_height == Panel::height;
+        StripRenderer<Panel> renderer(framebuffer.data(), strip.data(), &no_overlay, !covers_panel);
+        auto resampler = make_resampler(plan, !Panel::palette, acc.data(), [&](uint16_t x, uint16_t y, uint8_t value) {
+          put_packed_nibble(renderer.row(y), x, tone_map.nibble[value]);
+        });
+        for (uint16_t y = 0; y < geometry.height && !resampler.done(); y++)
+        {
+          if (y == rows)
+          {
+            renderer.fill_from(resampler.next_row(), Panel::white << 4 | Panel::white);
+            break;
+          }
+          resampler.push_row(&source[y * row_bytes]);
+        }
+        renderer.finish();
+
+        char what[40];
+        snprintf(what, sizeof(what), "%ux%u %s%s", geometry.width, geometry.height, fit == FIT_CROP ? "crop" : "letterbox",
+                 rows < geometry.height ? " short" : "");
+        ok = compare(name, what, expected.data, framebuffer.data()) && ok;
+      }
+    }
+  }
+
+  printf("%-14s %s\n", name, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+int main()
+{
+  // INKPLATE_WHITE, INKPLATE_BLACK, ACEP_COLOR_WHITE and ACEP_COLOR_BLACK
+  // of the drivers.
+  const legacy_description_t inkplate_gray = {LEGACY_INKPLATE_GRAY, true, 7, 0, 0xff, "/tone_gray.txt"};
+  const legacy_description_t inkplate_color = {LEGACY_INKPLATE_COLOR, false, 1, 0, 0x11, "/tone_color.txt"};
+  const legacy_description_t acep = {LEGACY_ACEP, false, 1, 0, 0x11, "/tone_acep.txt"};
+  bool ok = true;
+
+  ok = check_panel<InkplateGrayPanel<800, 600>>("inkplate6", inkplate_gray, 800, 600) && ok;
+  ok = check_panel<InkplateGrayPanel<1024, 758>>("inkplate6plus", inkplate_gray, 1024, 758) && ok;
+  ok = check_panel<InkplateGrayPanel<1200, 825>>("inkplate10", inkplate_gray, 1200, 825) && ok;
+  ok = check_panel<InkplateColorPanel>("inkplate6color", inkplate_color, 600, 448) && ok;
+  ok = check_panel<AcepPanel>("acep", acep, 600, 448) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,889 @@
+// Host converter for photos.
+//
+// Converts a directory tree of JPEG and PNG images into the raw 4 bit format
+// read by the firmware: panel resolution, two pixels per byte with the left
+// one in the high nibble, no header. Grayscale panels get gray levels, color
+// panels palette indices, both with Floyd-Steinberg dithering. Quantization
+// and the panel descriptions are shared with the firmware (src/quantize.h,
+// src/panel_backend.h, src/resample.h).
+//
+// Images are decoded row by row and scaled on the fly with a box filter, so
+// memory use is independent of the image size. JPEGs are additionally
+// downscaled by the decoder where possible. A work stealing pool runs one
+// conversion per image on all cores.
+//
+// The firmware shows photos of sub directories of /photos, so every top level
+// directory of the source tree becomes a directory in the output, with deeper
+// directories flattened into the file name. Images in the source root go to
+// the directory "unsorted".
+//
+// A manifest in the output directory records the content hash of every
+// converted source. Sources, which did not change since the last run, are
+// skipped. Outputs of removed sources are deleted.
+//
+// Build and run from the repository root:
+//   g++ -O2 -std=c++17 -pthread -Isrc tools/photo_convert.cpp -ljpeg -lpng -o photo_convert
+//   ./photo_convert -t inkplate6color ~/Pictures /media/sd/photos
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#include "panel_backend.h"
+#include "quantize.h"
+#include "resample.h"
+
+namespace fs = std::filesystem;
+
+#define MANIFEST_NAME ".photo_convert"
+#define MANIFEST_HEADER "# photo_convert manifest 1"
+#define HASH_BUFFER_SIZE 65536
+
+// Source of RGB rows, filled by one of the decoders.
+class ImageSource
+{
+public:
+  virtual ~ImageSource() {}
+  // Opens the image and decodes its header.
+  virtual bool open(FILE *fp) = 0;
+  // Allows the decoder to reduce the image down to the given resolution.
+  virtual void reduce(uint32_t min_width, uint32_t min_height) = 0;
+  virtual bool start() = 0;
+  virtual bool read_row(uint8_t *rgb) = 0;
+
+  uint32_t width = 0;
+  uint32_t height = 0;
+};
+
+// libjpeg reports errors by calling error_exit, which must not return. Every
+// call into the library therefore sets a jump target first.
+struct jpeg_error
+{
+  jpeg_error_mgr manager;
+  jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr info)
+{
+  longjmp(((jpeg_error *)info->err)->jump, 1);
+}
+
+class JpegSource : public ImageSource
+{
+public:
+  JpegSource()
+  {
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = jpeg_error_exit;
+    jpeg_create_decompress(&info);
+  }
+
+  ~JpegSource() override
+  {
+    jpeg_destroy_decompress(&info);
+  }
+
+  bool open(FILE *fp) override
+  {
+    if (setjmp(error.jump))
+    {
+      return false;
+    }
+    jpeg_stdio_src(&info, fp);
+    jpeg_read_header(&info, TRUE);
+    info.out_color_space = JCS_RGB;
+    info.dct_method = JDCT_ISLOW;
+    width = info.image_width;
+    height = info.image_height;
+    return true;
+  }
+
+  // Picks the largest DCT scaling, which keeps the image at least at the
+  // requested resolution. This skips most of the decoding work for large
+  // photos.
+  void reduce(uint32_t min_width, uint32_t min_height) override
+  {
+    unsigned int denom = 8;
+    while (denom > 1 && (info.image_width / denom < min_width || info.image_height / denom < min_height))
+    {
+      denom /= 2;
+    }
+    info.scale_num = 1;
+    info.scale_denom = denom;
+  }
+
+  bool start() override
+  {
+    if (setjmp(error.jump))
+    {
+      return false;
+    }
+    jpeg_start_decompress(&info);
+    width = info.output_width;
+    height = info.output_height;
+    return info.output_components == 3;
+  }
+
+  bool read_row(uint8_t *rgb) override
+  {
+    if (setjmp(error.jump))
+    {
+      return false;
+    }
+    JSAMPROW row = rgb;
+    return jpeg_read_scanlines(&info, &row, 1) == 1;
+  }
+
+private:
+  jpeg_decompress_struct info;
+  jpeg_error error;
+};
+
+class PngSource : public ImageSource
+{
+public:
+  ~PngSource() override
+  {
+    png_destroy_read_struct(&png, &info, nullptr);
+  }
+
+  bool open(FILE *fp) override
+  {
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (png == nullptr || (info = png_create_info_struct(png)) == nullptr)
+    {
+      return false;
+    }
+    if (setjmp(png_jmpbuf(png)))
+    {
+      return false;
+    }
+    png_init_io(png, fp);
+    png_read_info(png, info);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    if ((png_get_color_type(png, info) & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS))
+    {
+      // Transparent areas become white, like the paper of the panel.
+      const png_uint_16 white = png_get_bit_depth(png, info) == 16 ? 0xffff : 0xff;
+      png_color_16 background = {0, white, white, white, white};
+      png_set_background(png, &background, PNG_BACKGROUND_GAMMA_FILE, 1, 1.0);
+    }
+    interlaced = png_set_interlace_handling(png) > 1;
+    png_read_update_info(png, info);
+    width = png_get_image_width(png, info);
+    height = png_get_image_height(png, info);
+    return true;
+  }
+
+  void reduce(uint32_t, uint32_t) override
+  {
+  }
+
+  bool start() override
+  {
+    if (png_get_rowbytes(png, info) != width * 3)
+    {
+      return false;
+    }
+    if (!interlaced)
+    {
+      return true;
+    }
+
+    // Interlaced images are spread over the whole file, so they can only be
+    // decoded as a whole.
+    image.resize((size_t)width * height * 3);
+    std::vector<png_bytep> rows(height);
+    for (uint32_t y = 0; y < height; y++)
+    {
+      rows[y] = &image[(size_t)y * width * 3];
+    }
+    if (setjmp(png_jmpbuf(png)))
+    {
+      return false;
+    }
+    png_read_image(png, rows.data());
+    return true;
+  }
+
+  bool read_row(uint8_t *rgb) override
+  {
+    if (interlaced)
+    {
+      memcpy(rgb, &image[(size_t)next_row++ * width * 3], width * 3);
+      return true;
+    }
+    if (setjmp(png_jmpbuf(png)))
+    {
+      return false;
+    }
+    png_read_row(png, rgb, nullptr);
+    return true;
+  }
+
+private:
+  png_structp png = nullptr;
+  png_infop info = nullptr;
+  bool interlaced = false;
+  std::vector<uint8_t> image;
+  uint32_t next_row = 0;
+};
+
+// Box filter scaling of RGB rows according to a resample plan, like
+// PhotoResampler in box mode, only with three 8 bit channels. Rows are handed
+// to the sink as soon as they are complete.
+template <typename Sink>
+class RgbScaler
+{
+public:
+  RgbScaler(const resample_plan_t &plan, Sink sink)
+      : plan(plan), sink(sink), acc(plan.dst_width * 3), row(plan.dst_width * 3), begin(plan.dst_width), end(plan.dst_width)
+  {
+    for (uint16_t x = 0; x < plan.dst_width; x++)
+    {
+      begin[x] = plan.crop_x + resample_span_begin(x, plan.step_x);
+      end[x] = plan.crop_x + resample_span_end(x, plan.step_x);
+    }
+  }
+
+  void push_row(const uint8_t *rgb)
+  {
+    const uint32_t y = src_row++;
+    if (y < plan.crop_y)
+    {
+      return;
+    }
+    const uint32_t rel_y = y - plan.crop_y;
+
+    while (dst_row < plan.dst_height)
+    {
+      if (rel_y < resample_span_begin(dst_row, plan.step_y))
+      {
+        return;
+      }
+      accumulate(rgb);
+      if (rel_y + 1 < resample_span_end(dst_row, plan.step_y))
+      {
+        return;
+      }
+      emit();
+      ++dst_row;
+    }
+  }
+
+  bool done() const
+  {
+    return dst_row >= plan.dst_height;
+  }
+
+private:
+  void accumulate(const uint8_t *rgb)
+  {
+    for (uint16_t x = 0; x < plan.dst_width; x++)
+    {
+      uint32_t sum[3] = {0, 0, 0};
+      for (uint16_t sx = begin[x]; sx < end[x]; sx++)
+      {
+        sum[0] += rgb[sx * 3];
+        sum[1] += rgb[sx * 3 + 1];
+        sum[2] += rgb[sx * 3 + 2];
+      }
+      acc[x * 3] += sum[0];
+      acc[x * 3 + 1] += sum[1];
+      acc[x * 3 + 2] += sum[2];
+    }
+    ++acc_rows;
+  }
+
+  void emit()
+  {
+    for (uint16_t x = 0; x < plan.dst_width; x++)
+    {
+      const uint32_t count = acc_rows * (end[x] - begin[x]);
+      for (uint8_t c = 0; c < 3; c++)
+      {
+        row[x * 3 + c] = resample_average(acc[x * 3 + c], count);
+        acc[x * 3 + c] = 0;
+      }
+    }
+    acc_rows = 0;
+    sink(plan.dst_y + dst_row, row.data());
+  }
+
+  const resample_plan_t plan;
+  Sink sink;
+  std::vector<uint32_t> acc;
+  std::vector<uint8_t> row;
+  std::vector<uint16_t> begin;
+  std::vector<uint16_t> end;
+  uint32_t src_row = 0;
+  uint16_t dst_row = 0;
+  uint32_t acc_rows = 0;
+};
+
+template <typename Sink>
+RgbScaler<Sink> make_scaler(const resample_plan_t &plan, Sink sink)
+{
+  return RgbScaler<Sink>(plan, sink);
+}
+
+// Converts one image for Panel and writes the result to output.
+template <typename Panel>
+bool convert_photo(const fs::path &source, const fs::path &output, photo_fit_t fit, std::string *error)
+{
+  typedef PanelLayout<Panel> Layout;
+  const photo_geometry_t panel = {Panel::width, Panel::height};
+
+  std::string extension = source.extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  std::unique_ptr<ImageSource> image;
+  if (extension == ".png")
+  {
+    image.reset(new PngSource());
+  }
+  else
+  {
+    image.reset(new JpegSource());
+  }
+
+  FILE *in = fopen(source.c_str(), "rb");
+  if (in == nullptr)
+  {
+    *error = "could not open source";
+    return false;
+  }
+  std::unique_ptr<FILE, int (*)(FILE *)> in_guard(in, fclose);
+
+  if (!image->open(in))
+  {
+    *error = "could not decode header";
+    return false;
+  }
+  if (image->width == 0 || image->height == 0 || image->width > UINT16_MAX || image->height > UINT16_MAX)
+  {
+    *error = "unsupported resolution";
+    return false;
+  }
+
+  resample_plan_t plan;
+  plan_resample({(uint16_t)image->width, (uint16_t)image->height}, panel, fit, &plan);
+  const uint32_t visible_width = ((uint64_t)plan.step_x * plan.dst_width) >> 16;
+  const uint32_t visible_height = ((uint64_t)plan.step_y * plan.dst_height) >> 16;
+  image->reduce(plan.dst_width * image->width / std::max<uint32_t>(visible_width, 1),
+                plan.dst_height * image->height / std::max<uint32_t>(visible_height, 1));
+  if (!image->start())
+  {
+    *error = "could not start decoding";
+    return false;
+  }
+  plan_resample({(uint16_t)image->width, (uint16_t)image->height}, panel, fit, &plan);
+
+  const fs::path partial = output.string() + ".tmp";
+  FILE *out = fopen(partial.c_str(), "wb");
+  if (out == nullptr)
+  {
+    *error = "could not create output";
+    return false;
+  }
+
+  // Rows of the panel in RGB, with the letterbox background in white.
+  std::vector<uint8_t> panel_row(Panel::width * 3, 255);
+  std::vector<uint8_t> packed(Layout::stride);
+  std::vector<int16_t> errors(ERROR_DIFFUSION_SIZE(Panel::width, Panel::palette ? 3 : 1));
+  ErrorDiffusion diffusion(Panel::width, Panel::palette ? 3 : 1, errors.data());
+  uint16_t written_rows = 0;
+  bool write_ok = true;
+
+  auto write_row = [&]() {
+    if (Panel::palette)
+    {
+      diffusion.palette_row(panel_row.data(), seven_color_palette, 7, packed.data());
+    }
+    else
+    {
+      // The gray row is built in place, luma never needs more room than RGB.
+      for (uint16_t x = 0; x < Panel::width; x++)
+      {
+        panel_row[x] = luma(panel_row[x * 3], panel_row[x * 3 + 1], panel_row[x * 3 + 2]);
+      }
+      diffusion.gray_row(panel_row.data(), packed.data());
+    }
+    std::fill(panel_row.begin(), panel_row.end(), 255);
+    write_ok = write_ok && fwrite(packed.data(), 1, packed.size(), out) == packed.size();
+    ++written_rows;
+  };
+
+  auto scaler = make_scaler(plan, [&](uint16_t y, const uint8_t *rgb) {
+    while (written_rows < y)
+    {
+      write_row();
+    }
+    memcpy(&panel_row[plan.dst_x * 3], rgb, plan.dst_width * 3);
+    write_row();
+  });
+
+  std::vector<uint8_t> rgb(image->width * 3);
+  for (uint32_t y = 0; y < image->height && !scaler.done(); y++)
+  {
+    if (!image->read_row(rgb.data()))
+    {
+      *error = "could not decode row";
+      fclose(out);
+      fs::remove(partial);
+      return false;
+    }
+    scaler.push_row(rgb.data());
+  }
+  while (written_rows < Panel::height)
+  {
+    write_row();
+  }
+
+  if (fclose(out) != 0 || !write_ok)
+  {
+    *error = "could not write output";
+    fs::remove(partial);
+    return false;
+  }
+  std::error_code code;
+  fs::rename(partial, output, code);
+  if (code)
+  {
+    *error = "could not rename output";
+    return false;
+  }
+  return true;
+}
+
+typedef bool (*convert_function_t)(const fs::path &, const fs::path &, photo_fit_t, std::string *);
+
+typedef struct target
+{
+  const char *name;
+  convert_function_t convert;
+} target_t;
+
+const target_t targets[] = {
+    {"inkplate6", convert_photo<InkplateGrayPanel<800, 600>>},
+    {"inkplate6plus", convert_photo<InkplateGrayPanel<1024, 758>>},
+    {"inkplate10", convert_photo<InkplateGrayPanel<1200, 825>>},
+    {"inkplate6color", convert_photo<InkplateColorPanel>},
+    {"acep", convert_photo<AcepPanel>},
+};
+
+// 64 bit FNV-1a of the file contents.
+static bool hash_file(const fs::path &path, uint64_t *hash)
+{
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == nullptr)
+  {
+    return false;
+  }
+  std::vector<uint8_t> buffer(HASH_BUFFER_SIZE);
+  uint64_t value = 0xcbf29ce484222325ULL;
+  size_t n_bytes;
+  while ((n_bytes = fread(buffer.data(), 1, buffer.size(), fp)) > 0)
+  {
+    for (size_t i = 0; i < n_bytes; i++)
+    {
+      value = (value ^ buffer[i]) * 0x100000001b3ULL;
+    }
+  }
+  const bool ok = !ferror(fp);
+  fclose(fp);
+  *hash = value;
+  return ok;
+}
+
+typedef struct manifest_entry
+{
+  uint64_t hash;
+  std::string settings;
+  std::string output;
+} manifest_entry_t;
+
+typedef std::map<std::string, manifest_entry_t> manifest_t;
+
+static manifest_t read_manifest(const fs::path &path)
+{
+  manifest_t manifest;
+  FILE *fp = fopen(path.c_str(), "r");
+  if (fp == nullptr)
+  {
+    return manifest;
+  }
+
+  char line[4096];
+  while (fgets(line, sizeof(line), fp) != nullptr)
+  {
+    if (line[0] == '#')
+    {
+      continue;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    // source, hash, settings and output separated by tabs
+    char *fields[4];
+    char *cursor = line;
+    int count = 0;
+    for (; count < 4 && cursor != nullptr; count++)
+    {
+      fields[count] = cursor;
+      cursor = strchr(cursor, '\t');
+      if (cursor != nullptr)
+      {
+        *cursor++ = '\0';
+      }
+    }
+    if (count == 4)
+    {
+      manifest[fields[0]] = {strtoull(fields[1], nullptr, 16), fields[2], fields[3]};
+    }
+  }
+  fclose(fp);
+  return manifest;
+}
+
+static bool write_manifest(const fs::path &path, const manifest_t &manifest)
+{
+  const fs::path partial = path.string() + ".tmp";
+  FILE *fp = fopen(partial.c_str(), "w");
+  if (fp == nullptr)
+  {
+    return false;
+  }
+  fprintf(fp, "%s\n", MANIFEST_HEADER);
+  for (const auto &item : manifest)
+  {
+    fprintf(fp, "%s\t%016llx\t%s\t%s\n", item.first.c_str(), (unsigned long long)item.second.hash,
+            item.second.settings.c_str(), item.second.output.c_str());
+  }
+  if (fclose(fp) != 0)
+  {
+    return false;
+  }
+  std::error_code code;
+  fs::rename(partial, path, code);
+  return !code;
+}
+
+// Runs jobs 0 to count - 1 on a number of threads. Every worker owns a
+// queue, takes jobs from its back and steals from the front of the other
+// queues once it runs dry, so slow images do not leave cores idle.
+class WorkStealingPool
+{
+public:
+  explicit WorkStealingPool(unsigned int threads) : queues(threads) {}
+
+  template <typename Job>
+  void run(size_t count, Job job)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      queues[i % queues.size()].jobs.push_back(i);
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t self = 0; self < queues.size(); self++)
+    {
+      workers.emplace_back([this, self, &job]() {
+        size_t index;
+        while (take(self, &index))
+        {
+          job(index);
+        }
+      });
+    }
+    for (std::thread &worker : workers)
+    {
+      worker.join();
+    }
+  }
+
+private:
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+  };
+
+  bool take(size_t self, size_t *index)
+  {
+    {
+      Queue &own = queues[self];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.jobs.empty())
+      {
+        *index = own.jobs.back();
+        own.jobs.pop_back();
+        return true;
+      }
+    }
+    // No jobs are added while running, so all queues being empty once means
+    // the work is done.
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+      Queue &victim = queues[(self + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.jobs.empty())
+      {
+        *index = victim.jobs.front();
+        victim.jobs.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<Queue> queues;
+};
+
+typedef enum job_result
+{
+  JOB_CONVERTED,
+  JOB_SKIPPED,
+  JOB_FAILED,
+} job_result_t;
+
+typedef struct job
+{
+  std::string source;
+  std::string output;
+  uint64_t hash;
+  job_result_t result;
+  std::string error;
+} job_t;
+
+static bool is_image(const fs::path &path)
+{
+  std::string extension = path.extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  return extension == ".jpg" || extension == ".jpeg" || extension == ".png";
+}
+
+// Output path relative to the output directory for a source path relative to
+// the source directory.
+static std::string output_name(const fs::path &relative)
+{
+  std::vector<std::string> parts;
+  for (const fs::path &part : relative.parent_path())
+  {
+    parts.push_back(part.string());
+  }
+  std::string dir = parts.empty() ? "unsorted" : parts[0];
+  std::string name;
+  for (size_t i = 1; i < parts.size(); i++)
+  {
+    name += parts[i] + "_";
+  }
+  name += relative.stem().string();
+  return dir + "/" + name;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [-t target] [-j threads] [--letterbox] [--force] <source dir> <output dir>\n"
+          "Targets:",
+          program);
+  for (const target_t &target : targets)
+  {
+    fprintf(stderr, " %s", target.name);
+  }
+  fprintf(stderr, " (default inkplate6color)\n");
+}
+
+int main(int argc, char **argv)
+{
+  const target_t *target = &targets[3];
+  unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+  photo_fit_t fit = FIT_CROP;
+  bool force = false;
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if (arg == "-t" && i + 1 < argc)
+    {
+      const std::string name = argv[++i];
+      target = nullptr;
+      for (const target_t &candidate : targets)
+      {
+        if (name == candidate.name)
+        {
+          target = &candidate;
+        }
+      }
+      if (target == nullptr)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+    else if (arg == "-j" && i + 1 < argc)
+    {
+      threads = std::max(1, atoi(argv[++i]));
+    }
+    else if (arg == "--letterbox")
+    {
+      fit = FIT_LETTERBOX;
+    }
+    else if (arg == "--force")
+    {
+      force = true;
+    }
+    else if (arg[0] != '-')
+    {
+      paths.push_back(arg);
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (paths.size() != 2)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const fs::path source_dir = paths[0];
+  const fs::path output_dir = paths[1];
+  const fs::path manifest_path = output_dir / MANIFEST_NAME;
+  const std::string settings = std::string(target->name) + (fit == FIT_CROP ? ",crop" : ",letterbox");
+
+  std::vector<job_t> jobs;
+  std::error_code code;
+  for (fs::recursive_directory_iterator it(source_dir, code), end; !code && it != end; it.increment(code))
+  {
+    if (it->is_regular_file() && is_image(it->path()) && it->path().filename().string()[0] != '.')
+    {
+      jobs.push_back({fs::relative(it->path(), source_dir).generic_string(), "", 0, JOB_FAILED, ""});
+    }
+  }
+  if (code)
+  {
+    fprintf(stderr, "Could not read '%s': %s\n", source_dir.c_str(), code.message().c_str());
+    return 1;
+  }
+  std::sort(jobs.begin(), jobs.end(), [](const job_t &a, const job_t &b) { return a.source < b.source; });
+
+  // Names are assigned up front, so sources mapping to the same output get
+  // distinct names independent of the conversion order. A numbered name can
+  // itself be the name of another source, so numbers are tried until one is
+  // free.
+  std::map<std::string, int> used_names;
+  std::set<std::string> outputs;
+  for (job_t &job : jobs)
+  {
+    const std::string name = output_name(job.source);
+    int &seen = used_names[name];
+    do
+    {
+      job.output = name + (seen > 0 ? "_" + std::to_string(seen) : "") + ".bin";
+      ++seen;
+    } while (!outputs.insert(job.output).second);
+  }
+
+  const manifest_t old_manifest = read_manifest(manifest_path);
+  std::atomic<size_t> finished(0);
+  std::mutex progress_mutex;
+  const auto started = std::chrono::steady_clock::now();
+
+  WorkStealingPool pool(threads);
+  pool.run(jobs.size(), [&](size_t index) {
+    job_t &job = jobs[index];
+    const fs::path output = output_dir / job.output;
+    if (!hash_file(source_dir / job.source, &job.hash))
+    {
+      job.error = "could not read source";
+    }
+    else
+    {
+      const auto known = old_manifest.find(job.source);
+      std::error_code exists_error;
+      if (!force && known != old_manifest.end() && known->second.hash == job.hash && known->second.settings == settings &&
+          known->second.output == job.output && fs::exists(output, exists_error))
+      {
+        job.result = JOB_SKIPPED;
+      }
+      else
+      {
+        std::error_code dir_error;
+        fs::create_directories(output.parent_path(), dir_error);
+        job.result = target->convert(source_dir / job.source, output, fit, &job.error) ? JOB_CONVERTED : JOB_FAILED;
+      }
+    }
+
+    const size_t done = ++finished;
+    if (job.result == JOB_FAILED || done % 100 == 0 || done == jobs.size())
+    {
+      std::lock_guard<std::mutex> lock(progress_mutex);
+      if (job.result == JOB_FAILED)
+      {
+        fprintf(stderr, "%s: %s\n", job.source.c_str(), job.error.c_str());
+      }
+      fprintf(stderr, "%zu/%zu\r", done, jobs.size());
+    }
+  });
+
+  if (!jobs.empty())
+  {
+    fprintf(stderr, "\n");
+  }
+
+  manifest_t manifest;
+  size_t counts[3] = {0, 0, 0};
+  for (const job_t &job : jobs)
+  {
+    ++counts[job.result];
+    if (job.result != JOB_FAILED)
+    {
+      manifest[job.source] = {job.hash, settings, job.output};
+    }
+  }
+
+  // Outputs, which are no longer produced by any source.
+  size_t removed = 0;
+  for (const auto &item : old_manifest)
+  {
+    if (outputs.count(item.second.output) == 0)
+    {
+      if (fs::remove(output_dir / item.second.output, code))
+      {
+        ++removed;
+      }
+    }
+  }
+
+  if (!write_manifest(manifest_path, manifest))
+  {
+    fprintf(stderr, "Could not write manifest '%s'\n", manifest_path.c_str());
+    return 1;
+  }
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  printf("%zu converted, %zu unchanged, %zu failed, %zu removed in %.2fs (%.1f images/s, %u threads)\n",
+         counts[JOB_CONVERTED], counts[JOB_SKIPPED], counts[JOB_FAILED], removed, seconds,
+         seconds > 0 ? counts[JOB_CONVERTED] / seconds : 0.0, threads);
+  return counts[JOB_FAILED] > 0 ? 2 : 0;
+}
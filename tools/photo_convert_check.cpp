@@ -0,0 +1,141 @@
+// Host check of the incremental runs of photo_convert.
+//
+// Generates a small source tree in a temporary directory and runs the given
+// photo_convert binary on it several times, checking which outputs exist
+// after every run. Covers sources mapping to the same output name, which get
+// numbered names and need to survive runs skipping them as unchanged, the
+// removal of outputs whose source was deleted and images too wide or too tall
+// to cover a whole pixel once scaled.
+//
+// Build and run from the repository root:
+//   g++ -O2 -std=c++17 -pthread -Isrc tools/photo_convert.cpp -ljpeg -lpng -o photo_convert
+//   g++ -O2 -std=c++17 tools/photo_convert_check.cpp -lpng -o photo_convert_check
+//   ./photo_convert_check ./photo_convert
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <png.h>
+
+namespace fs = std::filesystem;
+
+static bool write_png(const fs::path &path, uint32_t width, uint32_t height, uint8_t seed)
+{
+  FILE *fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr)
+  {
+    return false;
+  }
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  png_infop info = png != nullptr ? png_create_info_struct(png) : nullptr;
+  if (info == nullptr || setjmp(png_jmpbuf(png)))
+  {
+    png_destroy_write_struct(&png, &info);
+    fclose(fp);
+    return false;
+  }
+
+  std::vector<uint8_t> row(width * 3);
+  png_init_io(png, fp);
+  png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+  for (uint32_t y = 0; y < height; y++)
+  {
+    for (uint32_t x = 0; x < width; x++)
+    {
+      row[x * 3] = x * seed;
+      row[x * 3 + 1] = y * seed;
+      row[x * 3 + 2] = (x + y) * seed;
+    }
+    png_write_row(png, row.data());
+  }
+  png_write_end(png, nullptr);
+  png_destroy_write_struct(&png, &info);
+  return fclose(fp) == 0;
+}
+
+// Runs photo_convert with options and compares the outputs in dir with
+// expected.
+static bool run(const std::string &program, const char *options, const fs::path &source, const fs::path &output,
+                const char *dir, const char *step, const std::set<std::string> &expected)
+{
+  const std::string command =
+      "'" + program + "' " + options + " '" + source.string() + "' '" + output.string() + "'";
+  printf("%s: ", step);
+  fflush(stdout);
+  if (system(command.c_str()) != 0)
+  {
+    fprintf(stderr, "%s: photo_convert failed\n", step);
+    return false;
+  }
+
+  std::set<std::string> found;
+  for (const fs::directory_entry &entry : fs::directory_iterator(output / dir))
+  {
+    found.insert(entry.path().filename().string());
+  }
+  if (found != expected)
+  {
+    fprintf(stderr, "%s: unexpected outputs:", step);
+    for (const std::string &name : found)
+    {
+      fprintf(stderr, " %s", name.c_str());
+    }
+    fprintf(stderr, "\n");
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "Usage: %s <photo_convert binary>\n", argv[0]);
+    return 1;
+  }
+  const std::string program = fs::absolute(argv[1]).string();
+  const fs::path root = fs::temp_directory_path() / "photo_convert_check_tree";
+  const fs::path source = root / "source";
+  const fs::path output = root / "output";
+
+  fs::remove_all(root);
+  fs::create_directories(source / "a");
+  // x.PNG and x.png both map to a/x, x_1.png asks for the number x.png got.
+  // Needs a case sensitive file system.
+  if (!write_png(source / "a" / "x.PNG", 64, 48, 3) || !write_png(source / "a" / "x.png", 64, 48, 5) ||
+      !write_png(source / "a" / "x_1.png", 64, 48, 7))
+  {
+    fprintf(stderr, "Could not write sources to %s\n", source.c_str());
+    return 1;
+  }
+
+  const char *options = "-t inkplate6";
+  bool ok = run(program, options, source, output, "a", "first run", {"x.bin", "x_1.bin", "x_1_1.bin"}) &&
+            run(program, options, source, output, "a", "unchanged", {"x.bin", "x_1.bin", "x_1_1.bin"});
+  if (ok)
+  {
+    fs::remove(source / "a" / "x.png");
+    ok = run(program, options, source, output, "a", "removed", {"x.bin", "x_1.bin"});
+  }
+
+  // Aspect ratios scaling to less than a pixel in one direction.
+  const fs::path extreme = root / "extreme";
+  fs::create_directories(extreme / "b");
+  if (!write_png(extreme / "b" / "wide.png", 2000, 1, 3) || !write_png(extreme / "b" / "tall.png", 1, 2000, 5))
+  {
+    fprintf(stderr, "Could not write sources to %s\n", extreme.c_str());
+    return 1;
+  }
+  ok = ok && run(program, "-t acep --letterbox", extreme, root / "letterbox", "b", "letterbox", {"wide.bin", "tall.bin"});
+  ok = ok && run(program, "-t inkplate6", extreme, root / "crop", "b", "crop", {"wide.bin", "tall.bin"});
+
+  fs::remove_all(root);
+  printf("%s\n", ok ? "ok" : "FAILED");
+  return ok ? 0 : 1;
+}